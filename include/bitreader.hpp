@@ -0,0 +1,102 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#pragma once
+
+#ifdef _MSC_VER
+#include <cstdlib>
+#endif
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+namespace KalaData
+{
+	using std::memcpy;
+
+	//Reads MSB first bits from a buffer, the next unread bits sit at the top of bitBuf.
+	//Huffman bitstreams and tANS state bits are both read through it
+	struct BitReader
+	{
+		const uint8_t* data = nullptr;
+		const uint8_t* end = nullptr;
+		uint64_t bitBuf = 0;
+		uint32_t bitCount = 0;
+
+		BitReader() = default;
+		BitReader(
+			const uint8_t* src,
+			size_t size) :
+			data(src),
+			end(src + size) {}
+
+		//Tops the buffer up to at least 56 bits, bits past the end of the stream read as zero
+		void Refill()
+		{
+			if (end - data >= 8)
+			{
+				//load 8 bytes at once and keep the whole bytes that fit, the partial byte
+				//below them is loaded again by the next refill and ors in unchanged
+				uint64_t word{};
+				memcpy(&word, data, sizeof(uint64_t));
+
+				bitBuf |= ByteSwap64(word) >> bitCount;
+				data += (63 - bitCount) >> 3;
+				bitCount |= 56;
+				return;
+			}
+
+			while (bitCount <= 56
+				&& data < end)
+			{
+				bitBuf |= static_cast<uint64_t>(*data++) << (56 - bitCount);
+				bitCount += 8;
+			}
+		}
+
+		//Returns the next length bits without taking them, length must be 1 to 64
+		uint64_t Peek(uint32_t length) const { return bitBuf >> (64 - length); }
+
+		//Takes length bits, returns false without taking any if the stream ran out
+		bool Skip(uint32_t length)
+		{
+			if (length > bitCount) return false;
+
+			bitBuf <<= length;
+			bitCount -= length;
+			return true;
+		}
+
+		//Reads length bits, a length of 0 reads nothing. Returns false if the stream ran out
+		bool Read(
+			uint32_t length,
+			uint32_t& value)
+		{
+			//shifting in two steps keeps length 0 well defined
+			value = (uint32_t)((bitBuf >> 1) >> (63 - length));
+			return Skip(length);
+		}
+
+		//Reads length bits without checking, only valid right after a refill
+		//that left at least 56 bits and for at most 56 bits in total
+		uint32_t ReadFast(uint32_t length)
+		{
+			uint32_t value = (uint32_t)((bitBuf >> 1) >> (63 - length));
+
+			bitBuf <<= length;
+			bitCount -= length;
+			return value;
+		}
+	private:
+		static uint64_t ByteSwap64(uint64_t value)
+		{
+#ifdef _MSC_VER
+			return _byteswap_uint64(value);
+#else
+			return __builtin_bswap64(value);
+#endif
+		}
+	};
+}
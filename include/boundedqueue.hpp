@@ -0,0 +1,122 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+namespace KalaData
+{
+	using std::atomic;
+	using std::unique_ptr;
+	using std::make_unique;
+	using std::memory_order_relaxed;
+	using std::memory_order_acquire;
+	using std::memory_order_release;
+
+	//Fixed size queue that any number of threads can push to and pop from without locks.
+	//Every cell carries a sequence number that tells whether it is free for the push
+	//or filled for the pop at the current position, so both ends only race on one counter each
+	template <typename T>
+	class BoundedQueue
+	{
+	public:
+		//Capacity is rounded up to a power of two
+		explicit BoundedQueue(size_t capacity)
+		{
+			size_t size = 1;
+			while (size < capacity) size <<= 1;
+
+			cells = make_unique<Cell[]>(size);
+			mask = size - 1;
+
+			for (size_t i = 0; i < size; i++) cells[i].sequence.store(i, memory_order_relaxed);
+		}
+
+		//Returns false if the queue is full
+		bool TryPush(const T& value)
+		{
+			size_t pos = tail.load(memory_order_relaxed);
+			while (true)
+			{
+				Cell& cell = cells[pos & mask];
+				size_t sequence = cell.sequence.load(memory_order_acquire);
+				intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+				if (diff == 0)
+				{
+					if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+					{
+						cell.value = value;
+						cell.sequence.store(pos + 1, memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0) return false;
+				else pos = tail.load(memory_order_relaxed);
+			}
+		}
+
+		//Returns false if the queue is empty
+		bool TryPop(T& value)
+		{
+			size_t pos = head.load(memory_order_relaxed);
+			while (true)
+			{
+				Cell& cell = cells[pos & mask];
+				size_t sequence = cell.sequence.load(memory_order_acquire);
+				intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+				if (diff == 0)
+				{
+					if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+					{
+						value = std::move(cell.value);
+						cell.sequence.store(pos + mask + 1, memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0) return false;
+				else pos = head.load(memory_order_relaxed);
+			}
+		}
+	private:
+		struct Cell
+		{
+			atomic<size_t> sequence{};
+			T value{};
+		};
+
+		unique_ptr<Cell[]> cells{};
+		size_t mask{};
+
+		//kept on separate cache lines so pushing and popping threads do not slow each other down
+		alignas(64) atomic<size_t> head{};
+		alignas(64) atomic<size_t> tail{};
+	};
+
+	//Lets a thread sleep until another thread changes something it waits for.
+	//Read the epoch before checking the condition, then wait on that epoch,
+	//a notify in between changes the epoch so the wait returns at once
+	class WaitSignal
+	{
+	public:
+		uint32_t Prepare() const { return epoch.load(memory_order_acquire); }
+
+		void Wait(uint32_t seen) const { epoch.wait(seen, memory_order_acquire); }
+
+		void Notify()
+		{
+			epoch.fetch_add(1, memory_order_release);
+			epoch.notify_all();
+		}
+	private:
+		atomic<uint32_t> epoch{};
+	};
+}
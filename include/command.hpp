@@ -58,6 +58,15 @@ namespace KalaData
 		//Set compression mode to chosen value
 		static void Command_SetCompressionMode(const string& mode);
 
+		//Set Huffman block size to chosen value
+		static void Command_SetBlockSize(const string& size);
+
+		//Set chunk size of large files to chosen value
+		static void Command_SetChunkSize(const string& size);
+
+		//Set compression and decompression thread count to chosen value
+		static void Command_SetThreadCount(const string& count);
+
 		//Toggles compression verbose messages on and off
 		static void Command_ToggleCompressionVerbosity();
 
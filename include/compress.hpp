@@ -5,11 +5,13 @@
 
 #include <string>
 #include <algorithm>
+#include <thread>
 
 namespace KalaData
 {
 	using std::string;
 	using std::clamp;
+	using std::thread;
 
 	constexpr size_t WINDOW_SIZE_FASTEST  = static_cast<size_t>(4 * 1024);        //4KB
 	constexpr size_t WINDOW_SIZE_FAST     = static_cast<size_t>(32 * 1024);       //32KB
@@ -23,6 +25,43 @@ namespace KalaData
 	constexpr size_t LOOKAHEAD_SLOW     = 128;
 	constexpr size_t LOOKAHEAD_ARCHIVE  = 255;
 
+	constexpr size_t MAX_CHAIN_FASTEST  = 4;
+	constexpr size_t MAX_CHAIN_FAST     = 16;
+	constexpr size_t MAX_CHAIN_BALANCED = 64;
+	constexpr size_t MAX_CHAIN_SLOW     = 48;  //binary tree depth
+	constexpr size_t MAX_CHAIN_ARCHIVE  = 128; //binary tree depth
+	constexpr size_t MAX_CHAIN_ULTRA    = 256; //binary tree depth
+	constexpr size_t MAX_CHAIN_LIMIT    = 1024;
+
+	constexpr size_t BLOCK_SIZE_MIN     = static_cast<size_t>(64 * 1024);       //64KB
+	constexpr size_t BLOCK_SIZE_DEFAULT = static_cast<size_t>(256 * 1024);      //256KB
+	constexpr size_t BLOCK_SIZE_MAX     = static_cast<size_t>(4 * 1024) * 1024; //4MB
+
+	constexpr size_t CHUNK_SIZE_MIN     = static_cast<size_t>(4 * 1024) * 1024;  //4MB
+	constexpr size_t CHUNK_SIZE_DEFAULT = static_cast<size_t>(16 * 1024) * 1024; //16MB
+	constexpr size_t CHUNK_SIZE_MAX     = static_cast<size_t>(32 * 1024) * 1024; //32MB
+
+	constexpr size_t THREAD_COUNT_MAX = 256;
+
+	enum class MatchFinderType
+	{
+		MATCHFINDER_HASH_CHAIN,
+		MATCHFINDER_BINARY_TREE
+	};
+
+	enum class ParserType
+	{
+		PARSER_GREEDY,
+		PARSER_LAZY,
+		PARSER_OPTIMAL
+	};
+
+	enum class EntropyCoderType
+	{
+		ENTROPY_STATIC,
+		ENTROPY_ADAPTIVE
+	};
+
 	class Compress
 	{
 	public:
@@ -55,6 +94,83 @@ namespace KalaData
 		};
 		static size_t GetLookAhead() { return LOOKAHEAD; }
 
+		//Assign a new max search depth value, hash chain links or binary tree nodes
+		//visited per position, higher values find longer matches but search slower.
+		//Supported range 4-1024
+		static void SetMaxChain(size_t maxChainValue)
+		{
+			size_t clamped = clamp(
+				static_cast<int>(maxChainValue),
+				static_cast<int>(MAX_CHAIN_FASTEST),
+				static_cast<int>(MAX_CHAIN_LIMIT));
+
+			MAX_CHAIN = clamped;
+		};
+		static size_t GetMaxChain() { return MAX_CHAIN; }
+
+		//Assign the match finder used by the compressor,
+		//the binary tree is slower to update but stays fast on long repetitive data
+		static void SetMatchFinder(MatchFinderType matchFinderValue) { MATCH_FINDER = matchFinderValue; }
+		static MatchFinderType GetMatchFinder() { return MATCH_FINDER; }
+
+		//Assign the parser that chooses between literals and matches,
+		//the lazy parser looks one position ahead before taking a match,
+		//the optimal parser is several times slower but gives the smallest output
+		static void SetParser(ParserType parserValue) { PARSER = parserValue; }
+		static ParserType GetParser() { return PARSER; }
+
+		//Assign the entropy coder for the parsed tokens, static coders use one table per stream,
+		//the adaptive range coder models literals by the preceding bytes and is many times slower
+		static void SetEntropyCoder(EntropyCoderType entropyCoderValue) { ENTROPY_CODER = entropyCoderValue; }
+		static EntropyCoderType GetEntropyCoder() { return ENTROPY_CODER; }
+
+		//Assign how many symbols of a static coded stream share one Huffman table,
+		//longer streams are split into blocks that get their own table or reuse the previous one.
+		//Supported range 64KB-4MB
+		static void SetBlockSize(size_t blockSizeValue)
+		{
+			BLOCK_SIZE = clamp(
+				blockSizeValue,
+				BLOCK_SIZE_MIN,
+				BLOCK_SIZE_MAX);
+		};
+		static size_t GetBlockSize() { return BLOCK_SIZE; }
+
+		//Assign the size of the chunks that larger files are split into, each chunk is compressed
+		//on its own with a fresh window and tables so chunks of one file compress in parallel.
+		//0 keeps every file whole, supported range 4MB-32MB
+		static void SetChunkSize(size_t chunkSizeValue)
+		{
+			if (chunkSizeValue == 0)
+			{
+				CHUNK_SIZE = 0;
+				return;
+			}
+
+			CHUNK_SIZE = clamp(
+				chunkSizeValue,
+				CHUNK_SIZE_MIN,
+				CHUNK_SIZE_MAX);
+		};
+		static size_t GetChunkSize() { return CHUNK_SIZE; }
+
+		//Assign how many files or chunks are compressed or decompressed at the same time,
+		//0 uses every hardware thread.
+		//Supported range 0-256
+		static void SetThreadCount(size_t threadCountValue)
+		{
+			THREAD_COUNT = threadCountValue > THREAD_COUNT_MAX
+				? THREAD_COUNT_MAX
+				: threadCountValue;
+		};
+		static size_t GetThreadCount()
+		{
+			if (THREAD_COUNT != 0) return THREAD_COUNT;
+
+			size_t hardwareThreads = thread::hardware_concurrency();
+			return hardwareThreads == 0 ? 1 : hardwareThreads;
+		}
+
 		//Compresses selected folder straight to .kdat archive inside target folder,
 		//skips all safety checks that are handled in the Command class for the Compress command
 		static void CompressToArchive(
@@ -72,5 +188,26 @@ namespace KalaData
 
 		//Max match length
 		static inline size_t LOOKAHEAD = LOOKAHEAD_FASTEST;
+
+		//How many hash chain links are followed per position
+		static inline size_t MAX_CHAIN = MAX_CHAIN_FASTEST;
+
+		//Which structure indexes the window
+		static inline MatchFinderType MATCH_FINDER = MatchFinderType::MATCHFINDER_HASH_CHAIN;
+
+		//How tokens are chosen from the found matches
+		static inline ParserType PARSER = ParserType::PARSER_GREEDY;
+
+		//How the tokens are turned into bits
+		static inline EntropyCoderType ENTROPY_CODER = EntropyCoderType::ENTROPY_STATIC;
+
+		//Symbols per Huffman table
+		static inline size_t BLOCK_SIZE = BLOCK_SIZE_DEFAULT;
+
+		//Bytes per independently compressed chunk of a large file, 0 never splits files
+		static inline size_t CHUNK_SIZE = CHUNK_SIZE_DEFAULT;
+
+		//Compression and decompression threads, 0 follows the hardware
+		static inline size_t THREAD_COUNT = 0;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,70 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <cstdint>
+#include <cstddef>
+
+namespace KalaData
+{
+	using std::string;
+	using std::vector;
+	using std::filesystem::path;
+
+	//One range of one file to read or write
+	struct FileRequest
+	{
+		path file{};
+		uint64_t offset{};
+		uint8_t* data{};
+		uint64_t size{};
+
+		//writes only: create the file or cut it to zero length before writing
+		bool create{};
+
+		//filled in by the batch. A read that hits the end of the file early
+		//is still ok, it just transfers fewer bytes
+		uint64_t transferred{};
+		bool ok{};
+	};
+
+	struct FileIOStats
+	{
+		//system calls spent opening, reading, writing and closing batched files
+		uint64_t syscalls;
+		uint64_t files;
+
+		//time from opening a file to closing it again
+		double latencyTotal;
+		double latencyMax;
+
+		//some batches ran on iostreams, which decide on their own how many system calls they make,
+		//so their share of syscalls is estimated from the stream calls
+		bool estimated;
+	};
+
+	//Reads and writes many files at once. On Linux the requests of a batch are queued
+	//on an io_uring so every open, transfer and close of the batch is submitted with
+	//a handful of system calls, elsewhere or if io_uring is not available they go through iostreams
+	class FileIO
+	{
+	public:
+		//Requests on the same file share one open of it
+		static void ReadBatch(vector<FileRequest>& requests);
+
+		static void WriteBatch(vector<FileRequest>& requests);
+
+		//io_uring, iostream or both, whichever the batches since the last reset ran on, none if there were none
+		static string GetBackendName();
+
+		//Counters over every thread since the last reset
+		static FileIOStats GetStats();
+		static void ResetStats();
+	};
+}
@@ -0,0 +1,67 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#pragma once
+
+#include <filesystem>
+#include <span>
+#include <cstdint>
+#include <cstddef>
+
+namespace KalaData
+{
+	using std::span;
+	using std::filesystem::path;
+
+	struct MappedFileStats
+	{
+		//system calls spent opening, advising, faulting in zeros for and closing views
+		uint64_t syscalls;
+		uint64_t views;
+	};
+
+	//Read-only view of a range of a file mapped into memory. The pages are read in as they are
+	//first touched, with the kernel told up front that they are read once from start to end.
+	//A page the file no longer has, because it was cut short or could not be read, does not crash the reader:
+	//the rest of the view turns into zeros and the mapping is marked as faulted instead
+	class MappedFile
+	{
+	public:
+		MappedFile() = default;
+		~MappedFile() { Close(); }
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		//Maps length bytes of file from offset on. Returns false if the file is shorter than that
+		//or can not be mapped, such as pipes and devices, callers read those the usual way instead
+		bool Open(
+			const path& file,
+			uint64_t offset,
+			uint64_t length);
+
+		void Close();
+
+		span<const uint8_t> GetData() const { return { data, size }; }
+
+		//True once a read of the view hit a page that was not there. Everything read
+		//from the view may be partly zeros then and has to be read again the usual way
+		bool IsFaulted() const;
+
+		//Counters over every thread since the last reset
+		static MappedFileStats GetStats();
+		static void ResetStats();
+	private:
+		//the view starts at the page or allocation boundary below the requested offset
+		void* view{};
+		size_t viewSize{};
+
+		const uint8_t* data{};
+		size_t size{};
+
+		//where the fault handler finds this view
+		size_t slot{};
+	};
+}
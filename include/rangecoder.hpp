@@ -0,0 +1,225 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace KalaData
+{
+	using std::vector;
+
+	//Binary arithmetic coder, every bit is coded with a 12-bit chance of being 1.
+	//Carries are avoided by shifting out bytes once the top byte of the range is settled
+	class RangeEncoder
+	{
+	public:
+		//Chances are clamped to 1-4095 so both bit values stay codable
+		void Encode(
+			uint32_t bit,
+			uint32_t chance)
+		{
+			uint32_t mid = low + (uint32_t)(((uint64_t)(high - low) * chance) >> 12);
+
+			if (bit) high = mid;
+			else low = mid + 1;
+
+			while (((low ^ high) & 0xFF000000) == 0)
+			{
+				out.push_back((uint8_t)(high >> 24));
+				low <<= 8;
+				high = (high << 8) | 0xFF;
+			}
+		}
+
+		//Stores the remaining range, must be called once after the last bit
+		void Flush();
+
+		vector<uint8_t>& GetOutput() { return out; }
+	private:
+		uint32_t low = 0;
+		uint32_t high = 0xFFFFFFFF;
+		vector<uint8_t> out{};
+	};
+
+	class RangeDecoder
+	{
+	public:
+		RangeDecoder(
+			const uint8_t* data,
+			size_t size);
+
+		uint32_t Decode(uint32_t chance)
+		{
+			uint32_t mid = low + (uint32_t)(((uint64_t)(high - low) * chance) >> 12);
+			uint32_t bit = code <= mid;
+
+			if (bit) high = mid;
+			else low = mid + 1;
+
+			while (((low ^ high) & 0xFF000000) == 0)
+			{
+				low <<= 8;
+				high = (high << 8) | 0xFF;
+				code = (code << 8) | NextByte();
+			}
+			return bit;
+		}
+
+		//A genuine stream never needs bytes past its end
+		bool IsOverrun() const { return overrun; }
+	private:
+		const uint8_t* data;
+		const uint8_t* end;
+		uint32_t low = 0;
+		uint32_t high = 0xFFFFFFFF;
+		uint32_t code = 0;
+		bool overrun = false;
+
+		uint8_t NextByte()
+		{
+			if (data < end) return *data++;
+
+			overrun = true;
+			return 0;
+		}
+	};
+
+	//Adaptive chance of a single binary decision
+	struct BitModel
+	{
+		//chance of a 1 in 1/65536 steps
+		uint16_t p = 32768;
+
+		void Encode(
+			RangeEncoder& encoder,
+			uint32_t bit)
+		{
+			encoder.Encode(bit, Chance());
+			Update(bit);
+		}
+
+		uint32_t Decode(RangeDecoder& decoder)
+		{
+			uint32_t bit = decoder.Decode(Chance());
+			Update(bit);
+			return bit;
+		}
+	private:
+		uint32_t Chance() const
+		{
+			uint32_t chance = p >> 4;
+			return chance == 0 ? 1 : chance;
+		}
+
+		void Update(uint32_t bit)
+		{
+			if (bit) p += (65536 - p) >> 5;
+			else p -= p >> 5;
+		}
+	};
+
+	//Codes BITS-bit values MSB first, each bit modeled on the bits above it
+	template <size_t BITS>
+	struct BitTree
+	{
+		BitModel models[size_t(1) << BITS]{};
+
+		void Encode(
+			RangeEncoder& encoder,
+			uint32_t value)
+		{
+			uint32_t node = 1;
+			for (size_t i = BITS; i-- > 0;)
+			{
+				uint32_t bit = (value >> i) & 1;
+				models[node].Encode(encoder, bit);
+				node = (node << 1) | bit;
+			}
+		}
+
+		uint32_t Decode(RangeDecoder& decoder)
+		{
+			uint32_t node = 1;
+			for (size_t i = 0; i < BITS; i++)
+			{
+				node = (node << 1) | models[node].Decode(decoder);
+			}
+			return node - (1u << BITS);
+		}
+	};
+
+	//Predicts literal bits by mixing order-0, order-1 and order-2 context predictions
+	//with the byte at the last match offset, in the logistic domain with weights learned while coding
+	class LiteralModel
+	{
+	public:
+		//The order-2 table holds 1 << order2Bits entries, a hash collision only costs ratio
+		LiteralModel(uint8_t order2Bits);
+
+		//expected is the byte one last-match-offset back, afterMatch is set for the first literal after a match
+		void Encode(
+			RangeEncoder& encoder,
+			uint8_t literal,
+			uint8_t prev1,
+			uint8_t prev2,
+			uint8_t expected,
+			bool afterMatch);
+
+		uint8_t Decode(
+			RangeDecoder& decoder,
+			uint8_t prev1,
+			uint8_t prev2,
+			uint8_t expected,
+			bool afterMatch);
+	private:
+		static constexpr size_t INPUTS = 5;
+
+		//counters hold a 16-bit chance of a 1 in the high half and how often they were updated in the low half
+		vector<uint32_t> order0{};
+		vector<uint32_t> order1{};
+		vector<uint32_t> order2{};
+		vector<uint32_t> expect{};
+		uint8_t order2Bits{};
+
+		//one weight set per bit position, whether the bits so far agree with the
+		//expected byte and whether the literal follows a match
+		vector<int32_t> weights{};
+
+		//Per byte: the table slots every bit of the byte is predicted from
+		struct Context
+		{
+			uint32_t* o1;
+			uint32_t* o2;
+			uint8_t expected;
+			bool afterMatch;
+		};
+
+		Context Select(
+			uint8_t prev1,
+			uint8_t prev2,
+			uint8_t expected,
+			bool afterMatch);
+
+		//Returns the mixed 12-bit chance of a 1 for the next bit below node,
+		//leaves the stretched inputs in st and the counters and weights used in slots and w
+		uint32_t Predict(
+			const Context& context,
+			size_t bitIndex,
+			uint32_t node,
+			int32_t st[INPUTS],
+			uint32_t* slots[INPUTS - 1],
+			int32_t*& w);
+
+		void Update(
+			const int32_t st[INPUTS],
+			uint32_t* const slots[INPUTS - 1],
+			int32_t* w,
+			uint32_t chance,
+			uint32_t bit);
+	};
+}
@@ -0,0 +1,58 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace KalaData
+{
+	using std::string;
+
+	enum class SimdLevel
+	{
+		SIMD_SCALAR,
+		SIMD_SSE2,
+		SIMD_AVX2
+	};
+
+	//How many bytes CopyMatch may write past the end of the copied range,
+	//buffers that are copied into must have this much spare room
+	constexpr size_t COPY_SLACK = 32;
+
+	class Simd
+	{
+	public:
+		//Widest instruction set the kernels were selected for at startup
+		static SimdLevel GetLevel() { return level; }
+		static string GetLevelName();
+
+		//Returns how many leading bytes of a and b are equal, never reads past a + limit or b + limit
+		static size_t MatchLength(
+			const uint8_t* a,
+			const uint8_t* b,
+			size_t limit)
+		{
+			return matchLength(a, b, limit);
+		}
+
+		//Copies length bytes that start offset bytes behind dst to dst,
+		//overlapping copies repeat the pattern like a bytewise LZ copy.
+		//May write up to COPY_SLACK bytes past dst + length
+		static void CopyMatch(
+			uint8_t* dst,
+			size_t offset,
+			size_t length)
+		{
+			copyMatch(dst, offset, length);
+		}
+	private:
+		static SimdLevel level;
+		static size_t (*matchLength)(const uint8_t*, const uint8_t*, size_t);
+		static void (*copyMatch)(uint8_t*, size_t, size_t);
+	};
+}
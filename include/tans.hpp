@@ -0,0 +1,36 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace KalaData
+{
+	using std::vector;
+
+	//Table-based asymmetric numeral system (FSE-style) entropy coder.
+	//Unlike Huffman it can spend a fraction of a bit on a symbol,
+	//which pays off on heavily skewed streams
+	class Tans
+	{
+	public:
+		//Largest state table is 1 << MAX_TABLE_LOG entries
+		static constexpr uint8_t MAX_TABLE_LOG = 11;
+
+		//Returns the coded payload, or an empty vector for empty input
+		static vector<uint8_t> Encode(const vector<uint8_t>& input);
+
+		//Decodes a payload written by Encode, returns false if it is malformed
+		//or would decode to more than maxSymbols bytes
+		static bool Decode(
+			const uint8_t* data,
+			size_t size,
+			size_t maxSymbols,
+			vector<uint8_t>& out);
+	};
+}
@@ -6,7 +6,6 @@
 #include <sstream>
 #include <string>
 #include <filesystem>
-#include <iomanip>
 #include <fstream>
 #include <unordered_map>
 #include <vector>
@@ -14,6 +13,7 @@
 #include <ranges>
 #include <cctype>
 #include <algorithm>
+#include <thread>
 
 #include "core.hpp"
 #include "command.hpp"
@@ -21,16 +21,20 @@
 
 using KalaData::Core;
 using KalaData::MessageType;
+using KalaData::MatchFinderType;
+using KalaData::ParserType;
+using KalaData::EntropyCoderType;
 
 using std::ostringstream;
 using std::string;
 using std::to_string;
+using std::stoull;
+using std::thread;
 using std::filesystem::path;
 using std::filesystem::exists;
 using std::filesystem::remove;
 using std::filesystem::is_regular_file;
 using std::filesystem::is_directory;
-using std::filesystem::file_size;
 using std::filesystem::is_empty;
 using std::filesystem::weakly_canonical;
 using std::filesystem::current_path;
@@ -38,9 +42,6 @@ using std::filesystem::create_directories;
 using std::filesystem::remove;
 using std::filesystem::remove_all;
 using std::filesystem::directory_iterator;
-using std::filesystem::recursive_directory_iterator;
-using std::fixed;
-using std::setprecision;
 using std::ofstream;
 using std::ios;
 using std::unordered_map;
@@ -51,29 +52,90 @@ using std::toupper;
 using std::ranges::any_of;
 using std::equal;
 
-static uint64_t GetFolderSize(const string& folderPath);
-
 static bool CanWriteToFolder(const string& folderPath);
 
-static string ConvertSizeToString(uint64_t size);
-
 static string ResolvePath(
 	const string& origin,
 	bool checkExistence = false);
 
+static string MatchFinderName(MatchFinderType type);
+
+static string ParserName(ParserType type);
+
+static string EntropyCoderName(EntropyCoderType type);
+
 struct Preset
 {
 	size_t window;
 	size_t lookahead;
+	size_t maxChain;
+	MatchFinderType matchFinder;
+	ParserType parser;
+	EntropyCoderType entropyCoder;
 };
 
 static const unordered_map<string, Preset> presets =
 {
-	{ "fastest",  { KalaData::WINDOW_SIZE_FASTEST,  KalaData::LOOKAHEAD_FASTEST  } },
-	{ "fast",     { KalaData::WINDOW_SIZE_FAST,     KalaData::LOOKAHEAD_FAST     } },
-	{ "balanced", { KalaData::WINDOW_SIZE_BALANCED, KalaData::LOOKAHEAD_BALANCED } },
-	{ "slow",     { KalaData::WINDOW_SIZE_SLOW,     KalaData::LOOKAHEAD_SLOW     } },
-	{ "archive",  { KalaData::WINDOW_SIZE_ARCHIVE,  KalaData::LOOKAHEAD_ARCHIVE  } }
+	{ "fastest",
+		{
+			KalaData::WINDOW_SIZE_FASTEST,
+			KalaData::LOOKAHEAD_FASTEST,
+			KalaData::MAX_CHAIN_FASTEST,
+			MatchFinderType::MATCHFINDER_HASH_CHAIN,
+			ParserType::PARSER_GREEDY,
+			EntropyCoderType::ENTROPY_STATIC
+		}
+	},
+	{ "fast",
+		{
+			KalaData::WINDOW_SIZE_FAST,
+			KalaData::LOOKAHEAD_FAST,
+			KalaData::MAX_CHAIN_FAST,
+			MatchFinderType::MATCHFINDER_HASH_CHAIN,
+			ParserType::PARSER_LAZY,
+			EntropyCoderType::ENTROPY_STATIC
+		}
+	},
+	{ "balanced",
+		{
+			KalaData::WINDOW_SIZE_BALANCED,
+			KalaData::LOOKAHEAD_BALANCED,
+			KalaData::MAX_CHAIN_BALANCED,
+			MatchFinderType::MATCHFINDER_HASH_CHAIN,
+			ParserType::PARSER_LAZY,
+			EntropyCoderType::ENTROPY_STATIC
+		}
+	},
+	{ "slow",
+		{
+			KalaData::WINDOW_SIZE_SLOW,
+			KalaData::LOOKAHEAD_SLOW,
+			KalaData::MAX_CHAIN_SLOW,
+			MatchFinderType::MATCHFINDER_BINARY_TREE,
+			ParserType::PARSER_OPTIMAL,
+			EntropyCoderType::ENTROPY_STATIC
+		}
+	},
+	{ "archive",
+		{
+			KalaData::WINDOW_SIZE_ARCHIVE,
+			KalaData::LOOKAHEAD_ARCHIVE,
+			KalaData::MAX_CHAIN_ARCHIVE,
+			MatchFinderType::MATCHFINDER_BINARY_TREE,
+			ParserType::PARSER_OPTIMAL,
+			EntropyCoderType::ENTROPY_STATIC
+		}
+	},
+	{ "ultra",
+		{
+			KalaData::WINDOW_SIZE_ARCHIVE,
+			KalaData::LOOKAHEAD_ARCHIVE,
+			KalaData::MAX_CHAIN_ULTRA,
+			MatchFinderType::MATCHFINDER_BINARY_TREE,
+			ParserType::PARSER_OPTIMAL,
+			EntropyCoderType::ENTROPY_ADAPTIVE
+		}
+	}
 };
 
 static const vector<string> restrictedFileNames
@@ -104,9 +166,6 @@ static const vector<string> restrictedFileNames
 	"LPT9",
 };
 
-//5GB max file size
-constexpr uint64_t maxFolderSize = 5ull * 1024 * 1024 * 1024;
-
 //where user has navigated with --go command
 static string currentPath{};
 
@@ -208,6 +267,27 @@ namespace KalaData
 			return;
 		}
 
+		else if (parameters.size() == 3
+			&& parameters[1] == "--sbs")
+		{
+			Command_SetBlockSize(parameters[2]);
+			return;
+		}
+
+		else if (parameters.size() == 3
+			&& parameters[1] == "--scs")
+		{
+			Command_SetChunkSize(parameters[2]);
+			return;
+		}
+
+		else if (parameters.size() == 3
+			&& parameters[1] == "--threads")
+		{
+			Command_SetThreadCount(parameters[2]);
+			return;
+		}
+
 		else if (parameters.size() == 2
 			&& parameters[1] == "--tvb")
 		{
@@ -295,7 +375,10 @@ namespace KalaData
 			<< "  - the command '-help command' expects a valid command, like '--help c'.\n"
 			<< "  - the commands '--go' and '--delete' expect a valid file or directory path in your device\n"
 			<< "  - the command '--create' expects a directory that does not exist\n"
-			<< "  - the command '--sm mode' expects a valid mode, like '--sm balanced'\n\n"
+			<< "  - the command '--sm mode' expects a valid mode, like '--sm balanced'\n"
+			<< "  - the command '--sbs size' expects a size in bytes, like '--sbs 262144'\n"
+			<< "  - the command '--scs size' expects a size in bytes, like '--scs 16777216', 0 keeps files up to 512MB whole\n"
+			<< "  - the command '--threads count' expects a thread count, like '--threads 8', 0 uses every hardware thread\n\n"
 
 			<< "Commands:\n"
 			<< "  --v\n"
@@ -310,6 +393,9 @@ namespace KalaData
 			<< "  --create path\n"
 			<< "  --delete path\n"
 			<< "  --sm mode\n"
+			<< "  --sbs size\n"
+			<< "  --scs size\n"
+			<< "  --threads count\n"
 			<< "  --tvb\n"
 			<< "  --c\n"
 			<< "  --dc\n"
@@ -420,27 +506,107 @@ namespace KalaData
 				<< "- fastest\n"
 				<< "  - best for temporary files\n"
 				<< "  - window size: " << WINDOW_SIZE_FASTEST << " bytes\n"
-				<< "  - lookahead: " << LOOKAHEAD_FASTEST << "\n\n"
+				<< "  - lookahead: " << LOOKAHEAD_FASTEST << "\n"
+				<< "  - max chain depth: " << MAX_CHAIN_FASTEST << "\n"
+				<< "  - match finder: hash chain\n"
+				<< "  - parser: greedy\n"
+				<< "  - entropy coder: static\n\n"
 				
 				<< "- fast\n"
 				<< "  - best for quick backups\n"
 				<< "  - window size: " << WINDOW_SIZE_FAST<< " bytes\n"
-				<< "  - lookahead: " << LOOKAHEAD_FAST << "\n\n"
+				<< "  - lookahead: " << LOOKAHEAD_FAST << "\n"
+				<< "  - max chain depth: " << MAX_CHAIN_FAST << "\n"
+				<< "  - match finder: hash chain\n"
+				<< "  - parser: lazy\n"
+				<< "  - entropy coder: static\n\n"
 				
 				<< "- balanced\n"
 				<< "  - best for general use\n"
 				<< "  - window size: " << WINDOW_SIZE_BALANCED << " bytes\n"
-				<< "  - lookahead: " << LOOKAHEAD_BALANCED << "\n\n"
+				<< "  - lookahead: " << LOOKAHEAD_BALANCED << "\n"
+				<< "  - max chain depth: " << MAX_CHAIN_BALANCED << "\n"
+				<< "  - match finder: hash chain\n"
+				<< "  - parser: lazy\n"
+				<< "  - entropy coder: static\n\n"
 				
 				<< "- slow\n"
 				<< "  - best for long term storage\n"
 				<< "  - window size: " << WINDOW_SIZE_SLOW << " bytes\n"
-				<< "  - lookahead: " << LOOKAHEAD_SLOW << "\n\n"
+				<< "  - lookahead: " << LOOKAHEAD_SLOW << "\n"
+				<< "  - max chain depth: " << MAX_CHAIN_SLOW << "\n"
+				<< "  - match finder: binary tree\n"
+				<< "  - parser: optimal\n"
+				<< "  - entropy coder: static\n\n"
 				
 				<< "- archive\n"
-				<< "  - best for maximum compression\n"
+				<< "  - best for maximum compression with fast decompression\n"
 				<< "  - window size: " << WINDOW_SIZE_ARCHIVE << " bytes\n"
-				<< "  - lookahead: " << LOOKAHEAD_ARCHIVE << "\n";
+				<< "  - lookahead: " << LOOKAHEAD_ARCHIVE << "\n"
+				<< "  - max chain depth: " << MAX_CHAIN_ARCHIVE << "\n"
+				<< "  - match finder: binary tree\n"
+				<< "  - parser: optimal\n"
+				<< "  - entropy coder: static\n\n"
+
+				<< "- ultra\n"
+				<< "  - best for data that is compressed once and kept for years\n"
+				<< "  - window size: " << WINDOW_SIZE_ARCHIVE << " bytes\n"
+				<< "  - lookahead: " << LOOKAHEAD_ARCHIVE << "\n"
+				<< "  - max chain depth: " << MAX_CHAIN_ULTRA << "\n"
+				<< "  - match finder: binary tree\n"
+				<< "  - parser: optimal\n"
+				<< "  - entropy coder: adaptive range coder\n";
+
+			Core::PrintMessage(ss.str());
+
+			return;
+		}
+
+		else if (commandName == "sbs"
+			|| commandName == "--sbs")
+		{
+			ostringstream ss{};
+
+			ss << "Sets how many symbols of a statically coded stream share one Huffman table.\n"
+				<< "Longer streams are split into blocks, each block gets its own table "
+				<< "or reuses the previous one when the statistics barely change.\n"
+				<< "Smaller blocks follow changing data closer, larger blocks spend less on tables.\n"
+				<< "Supported range: " << BLOCK_SIZE_MIN << "-" << BLOCK_SIZE_MAX << " bytes, "
+				<< "default: " << BLOCK_SIZE_DEFAULT << " bytes\n";
+
+			Core::PrintMessage(ss.str());
+
+			return;
+		}
+
+		else if (commandName == "scs"
+			|| commandName == "--scs")
+		{
+			ostringstream ss{};
+
+			ss << "Sets the size of the chunks that files larger than it are split into.\n"
+				<< "Every chunk is compressed on its own, so the chunks of one large file "
+				<< "compress on separate threads at the cost of a slightly worse ratio.\n"
+				<< "With 0, files larger than 512MB are still split into " << CHUNK_SIZE_MAX << " byte chunks "
+				<< "so they never have to fit in memory at once.\n"
+				<< "Supported range: " << CHUNK_SIZE_MIN << "-" << CHUNK_SIZE_MAX << " bytes or 0 to keep files whole, "
+				<< "default: " << CHUNK_SIZE_DEFAULT << " bytes\n";
+
+			Core::PrintMessage(ss.str());
+
+			return;
+		}
+
+		else if (commandName == "threads"
+			|| commandName == "--threads")
+		{
+			ostringstream ss{};
+
+			ss << "Sets how many files or chunks are compressed or decompressed at the same time.\n"
+				<< "Files are still written to the archive in the same order, "
+				<< "so the archive is identical for every thread count.\n"
+				<< "Supported range: 0-" << THREAD_COUNT_MAX << ", "
+				<< "default: 0 (every hardware thread, currently " << thread::hardware_concurrency() << ")\n";
 
 			Core::PrintMessage(ss.str());
 
@@ -487,8 +653,7 @@ namespace KalaData
 				<< "Origin:\n"
 				<< "  - path must exist\n"
 				<< "  - path must be a directory\n"
-				<< "  - directory must not be empty\n"
-				<< "  - directory size must not exceed 5GB\n\n"
+				<< "  - directory must not be empty\n\n"
 
 				<< "Target:\n"
 				<< "  - path must not exist\n"
@@ -748,18 +913,129 @@ namespace KalaData
 
 		Compress::SetWindowSize(it->second.window);
 		Compress::SetLookAhead(it->second.lookahead);
+		Compress::SetMaxChain(it->second.maxChain);
+		Compress::SetMatchFinder(it->second.matchFinder);
+		Compress::SetParser(it->second.parser);
+		Compress::SetEntropyCoder(it->second.entropyCoder);
 
 		ostringstream ss{};
 
 		ss << "Set compression mode to '" + mode + "'!\n"
 			<< "  Window size is '" << Compress::GetWindowSize() << " bytes'\n"
-			<< "  Lookahead is '" << Compress::GetLookAhead() << "'\n";
+			<< "  Lookahead is '" << Compress::GetLookAhead() << "'\n"
+			<< "  Max chain depth is '" << Compress::GetMaxChain() << "'\n"
+			<< "  Match finder is '" << MatchFinderName(Compress::GetMatchFinder()) << "'\n"
+			<< "  Parser is '" << ParserName(Compress::GetParser()) << "'\n"
+			<< "  Entropy coder is '" << EntropyCoderName(Compress::GetEntropyCoder()) << "'\n";
 
 		Core::PrintMessage(
 			ss.str(),
 			MessageType::MESSAGETYPE_SUCCESS);
 	}
 
+	void Command::Command_SetBlockSize(const string& size)
+	{
+		if (size.empty()
+			|| size.size() > 9
+			|| any_of(size, [](unsigned char c) { return !isdigit(c); }))
+		{
+			Core::PrintMessage(
+				"Block size '" + size + "' is not a valid number!\n",
+				MessageType::MESSAGETYPE_ERROR);
+
+			return;
+		}
+
+		size_t value = stoull(size);
+		if (value < BLOCK_SIZE_MIN
+			|| value > BLOCK_SIZE_MAX)
+		{
+			ostringstream ss{};
+
+			ss << "Block size '" << size << "' is outside the supported range "
+				<< BLOCK_SIZE_MIN << "-" << BLOCK_SIZE_MAX << " bytes!\n";
+
+			Core::PrintMessage(
+				ss.str(),
+				MessageType::MESSAGETYPE_ERROR);
+
+			return;
+		}
+
+		Compress::SetBlockSize(value);
+
+		Core::PrintMessage(
+			"Set Huffman block size to '" + to_string(Compress::GetBlockSize()) + " bytes'!\n",
+			MessageType::MESSAGETYPE_SUCCESS);
+	}
+
+	void Command::Command_SetChunkSize(const string& size)
+	{
+		if (size.empty()
+			|| size.size() > 9
+			|| any_of(size, [](unsigned char c) { return !isdigit(c); }))
+		{
+			Core::PrintMessage(
+				"Chunk size '" + size + "' is not a valid number!\n",
+				MessageType::MESSAGETYPE_ERROR);
+
+			return;
+		}
+
+		size_t value = stoull(size);
+		if (value != 0
+			&& (value < CHUNK_SIZE_MIN
+			|| value > CHUNK_SIZE_MAX))
+		{
+			ostringstream ss{};
+
+			ss << "Chunk size '" << size << "' is outside the supported range "
+				<< CHUNK_SIZE_MIN << "-" << CHUNK_SIZE_MAX << " bytes!\n";
+
+			Core::PrintMessage(
+				ss.str(),
+				MessageType::MESSAGETYPE_ERROR);
+
+			return;
+		}
+
+		Compress::SetChunkSize(value);
+
+		Core::PrintMessage(
+			"Set chunk size to '" + to_string(Compress::GetChunkSize()) + " bytes'!\n",
+			MessageType::MESSAGETYPE_SUCCESS);
+	}
+
+	void Command::Command_SetThreadCount(const string& count)
+	{
+		if (count.empty()
+			|| count.size() > 9
+			|| any_of(count, [](unsigned char c) { return !isdigit(c); }))
+		{
+			Core::PrintMessage(
+				"Thread count '" + count + "' is not a valid number!\n",
+				MessageType::MESSAGETYPE_ERROR);
+
+			return;
+		}
+
+		size_t value = stoull(count);
+		if (value > THREAD_COUNT_MAX)
+		{
+			Core::PrintMessage(
+				"Thread count '" + count + "' is outside the supported range 0-" + to_string(THREAD_COUNT_MAX) + "!\n",
+				MessageType::MESSAGETYPE_ERROR);
+
+			return;
+		}
+
+		Compress::SetThreadCount(value);
+
+		Core::PrintMessage(
+			"Set thread count to '" + to_string(Compress::GetThreadCount()) + "'!\n",
+			MessageType::MESSAGETYPE_SUCCESS);
+	}
+
 	void Command::Command_ToggleCompressionVerbosity()
 	{
 		bool state = Core::IsVerboseLoggingEnabled();
@@ -810,18 +1086,6 @@ namespace KalaData
 			return;
 		}
 
-		uint64_t originSize = GetFolderSize(canonicalOrigin);
-		if (originSize > maxFolderSize)
-		{
-			string convertedOriginSize = ConvertSizeToString(originSize);
-
-			Core::PrintMessage(
-				"Origin '" + canonicalOrigin + "' size '" + convertedOriginSize + "' exceeds max allowed size '5.00GB'!\n",
-				MessageType::MESSAGETYPE_ERROR);
-
-			return;
-		}
-
 		if (exists(canonicalTarget))
 		{
 			Core::PrintMessage(
@@ -917,18 +1181,6 @@ namespace KalaData
 	}
 }
 
-uint64_t GetFolderSize(const string& folderPath)
-{
-	uint64_t size{};
-
-	for (auto& p : recursive_directory_iterator(folderPath))
-	{
-		if (is_regular_file(p)) size += file_size(p);
-	}
-
-	return size;
-}
-
 bool CanWriteToFolder(const string& folderPath)
 {
 	try
@@ -951,18 +1203,6 @@ bool CanWriteToFolder(const string& folderPath)
 	}
 }
 
-string ConvertSizeToString(uint64_t size)
-{
-	ostringstream ss{};
-
-	ss << fixed
-		<< setprecision(2)
-		<< static_cast<double>(size) / (1024ull * 1024 * 1024)
-		<< "GB";
-
-	return ss.str();
-}
-
 string ResolvePath(
 	const string& origin,
 	bool checkExistence)
@@ -984,4 +1224,31 @@ string ResolvePath(
 		: path(currentPath) / origin;
 
 	return weakly_canonical(resolved).string();
+}
+
+string MatchFinderName(MatchFinderType type)
+{
+	return type == MatchFinderType::MATCHFINDER_BINARY_TREE
+		? "binary tree"
+		: "hash chain";
+}
+
+string ParserName(ParserType type)
+{
+	switch (type)
+	{
+	case ParserType::PARSER_LAZY:
+		return "lazy";
+	case ParserType::PARSER_OPTIMAL:
+		return "optimal";
+	default:
+		return "greedy";
+	}
+}
+
+string EntropyCoderName(EntropyCoderType type)
+{
+	return type == EntropyCoderType::ENTROPY_ADAPTIVE
+		? "adaptive range coder"
+		: "static";
 }
\ No newline at end of file
@@ -11,16 +11,49 @@
 #include <chrono>
 #include <iomanip>
 #include <queue>
-#include <map>
 #include <memory>
+#include <cstring>
+#include <bit>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <span>
 
 #include "core.hpp"
 #include "command.hpp"
 #include "compress.hpp"
+#include "simd.hpp"
+#include "tans.hpp"
+#include "rangecoder.hpp"
+#include "boundedqueue.hpp"
+#include "fileio.hpp"
+#include "mappedfile.hpp"
+#include "bitreader.hpp"
 
 using KalaData::Core;
 using KalaData::MessageType;
 using KalaData::Compress;
+using KalaData::Simd;
+using KalaData::Tans;
+using KalaData::RangeEncoder;
+using KalaData::RangeDecoder;
+using KalaData::BitModel;
+using KalaData::BitTree;
+using KalaData::LiteralModel;
+using KalaData::BoundedQueue;
+using KalaData::WaitSignal;
+using KalaData::FileIO;
+using KalaData::FileRequest;
+using KalaData::FileIOStats;
+using KalaData::MappedFile;
+using KalaData::BitReader;
+using KalaData::COPY_SLACK;
+using KalaData::WINDOW_SIZE_ARCHIVE;
+using KalaData::CHUNK_SIZE_MAX;
+using KalaData::MatchFinderType;
+using KalaData::ParserType;
+using KalaData::EntropyCoderType;
 
 using std::filesystem::path;
 using std::filesystem::create_directories;
@@ -28,31 +61,113 @@ using std::filesystem::relative;
 using std::filesystem::is_regular_file;
 using std::filesystem::weakly_canonical;
 using std::filesystem::file_size;
+using std::filesystem::resize_file;
 using std::filesystem::recursive_directory_iterator;
 using std::ofstream;
+using std::fstream;
 using std::ifstream;
 using std::ios;
 using std::streamoff;
 using std::streamsize;
-using std::istreambuf_iterator;
 using std::vector;
 using std::ostringstream;
 using std::string;
 using std::to_string;
+using std::error_code;
 using std::chrono::high_resolution_clock;
 using std::chrono::duration;
 using std::chrono::seconds;
 using std::fixed;
 using std::setprecision;
-using std::map;
 using std::priority_queue;
 using std::unique_ptr;
 using std::move;
 using std::make_unique;
 using std::memcmp;
+using std::bit_width;
+using std::log2;
+using std::thread;
+using std::atomic;
+using std::stable_sort;
+using std::min;
+using std::span;
 
 constexpr size_t MIN_MATCH = 3;
 
+//Code lengths are stored in 4 bits
+constexpr uint8_t MAX_CODE_LENGTH = 15;
+
+//Longest code the encoder builds, which keeps every decode table at 4096 entries or less
+constexpr uint8_t CODE_LENGTH_LIMIT = 12;
+
+//Huffman payloads start with one of these, frequency tables are only read for older archives
+constexpr uint8_t HUFFMAN_MODE_DENSE = 0;
+constexpr uint8_t HUFFMAN_MODE_SPARSE = 1;
+constexpr uint8_t HUFFMAN_MODE_CANONICAL = 2;
+constexpr uint8_t HUFFMAN_MODE_INTERLEAVED = 3;
+constexpr uint8_t HUFFMAN_MODE_BLOCKED = 4;
+
+//Every block of a blocked Huffman payload starts with one of these
+constexpr uint8_t BLOCK_NEW_TABLE = 0;
+constexpr uint8_t BLOCK_REPEAT_TABLE = 1;
+
+//Interleaved payloads are split into this many bitstreams
+constexpr size_t HUFFMAN_STREAMS = 4;
+
+//Smaller inputs keep one bitstream, the jump table and padding would cost more than the decode speed is worth
+constexpr size_t INTERLEAVE_MIN_SYMBOLS = 4096;
+
+//Entropy coder ids, stored in front of every non-empty coded stream of method 3
+constexpr uint8_t CODER_HUFFMAN = 0;
+constexpr uint8_t CODER_TANS = 1;
+
+//Archives of this version store one flag byte per token, later versions pack them
+constexpr int LEGACY_ARCHIVE_VERSION = 1;
+
+//The incompressible-data check looks at this many evenly spaced slices of this size
+constexpr size_t SAMPLE_SIZE = static_cast<size_t>(64 * 1024); //64KB
+constexpr size_t SAMPLE_COUNT = 4;
+
+//A slice counts as incompressible if its bytes are spread this evenly
+//and this few of its positions repeat the 4 bytes last seen under the same hash
+constexpr double SAMPLE_MIN_ENTROPY = 7.9;     //bits per byte
+constexpr double SAMPLE_MAX_MATCH_RATE = 0.01; //matched positions per byte
+
+//Files this small are always compressed, the estimate needs enough bytes to be worth anything
+constexpr size_t SAMPLE_MIN_FILE_SIZE = static_cast<size_t>(4 * 1024); //4KB
+
+//Chunked entries (method 5) start with the chunk count and the original bytes per chunk,
+//followed by a method byte, payload offset and stored size for every chunk
+constexpr size_t CHUNK_TABLE_HEADER = sizeof(uint32_t) + sizeof(uint32_t);
+constexpr size_t CHUNK_TABLE_ENTRY = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint64_t);
+
+//Read chunks wait in one queue per compression worker, compressed chunks wait for the writer in one shared queue
+constexpr size_t WORKER_QUEUE_SIZE = 16;
+constexpr size_t WRITER_QUEUE_SIZE = 256;
+
+//How many bytes of input files may be read but not yet written to the archive at once,
+//a single larger chunk is still compressed, but only once nothing else is in flight.
+//With chunking turned off, files larger than this are still split so they never have to fit in memory
+constexpr uint64_t IN_FLIGHT_LIMIT = static_cast<uint64_t>(512 * 1024) * 1024; //512MB
+
+//Small files are read and extracted in batches so their opens, transfers and closes are submitted together,
+//a batch ends at whichever limit it reaches first
+constexpr size_t IO_BATCH_FILES = 64;
+constexpr uint64_t IO_BATCH_BYTES = static_cast<uint64_t>(8 * 1024) * 1024; //8MB
+
+//Chunks of at least this size are compressed straight from a memory mapping of their file,
+//below it a mapping costs more in system calls and page faults than copying the bytes does
+constexpr uint64_t MAP_MIN_SIZE = static_cast<uint64_t>(1024) * 1024; //1MB
+
+//Extracted outputs larger than any chunk are written to their file while they are decoded,
+//only the window matches can reach back into and the output decoded since the last write are held
+constexpr uint64_t STREAM_OUTPUT_LIMIT = CHUNK_SIZE_MAX;
+constexpr size_t STREAM_WINDOW = WINDOW_SIZE_ARCHIVE;
+constexpr size_t STREAM_FLUSH_SIZE = static_cast<size_t>(16 * 1024) * 1024; //16MB
+
+//Streamed payloads that are decoded while they are read come from the archive in pieces of this size
+constexpr size_t STREAM_READ_SIZE = static_cast<size_t>(1024) * 1024; //1MB
+
 enum class ForceCloseType
 {
 	TYPE_COMPRESSION,
@@ -63,6 +178,48 @@ enum class ForceCloseType
 	TYPE_HUFFMAN_DECODE
 };
 
+//Part of a file that is read and compressed on its own
+struct ArchiveChunk
+{
+	uint64_t offset;
+	uint64_t size;
+
+	//the bytes to compress point into either the mapping or the bytes read into raw
+	unique_ptr<MappedFile> mapped;
+	vector<uint8_t> raw;
+	span<const uint8_t> input;
+
+	vector<uint8_t> compData;
+	bool skipped;
+	bool done;
+};
+
+//One file on its way into the archive, its chunks are filled in by workers and written out in order.
+//Entries of more than one chunk are streamed, each chunk is written and freed as soon as it is done
+struct ArchiveEntry
+{
+	path file;
+	string relPath;
+	uint64_t size;
+	uint64_t chunkSize;
+	vector<ArchiveChunk> chunks;
+};
+
+//One stored part of an archive entry that decodes into one part of an extracted file
+struct ExtractTask
+{
+	path outPath;
+	string relPath;
+	uint8_t method;
+	uint64_t storedOffset;
+	uint64_t storedSize;
+	uint64_t outputOffset;
+	uint64_t originalSize;
+
+	//whole files create their output file when they are written, chunks go into a file created up front
+	bool create;
+};
+
 struct Token
 {
 	bool isLiteral;
@@ -97,6 +254,62 @@ struct HuffNode
 
 };
 
+//Packs codes MSB first into a buffer that is already large enough,
+//bits collect in a 64-bit accumulator and are stored 32 at a time
+struct BitWriter
+{
+	uint8_t* out;
+	uint64_t acc = 0;
+	uint32_t count = 0;
+
+	BitWriter(uint8_t* dst) : out(dst) {}
+
+	//Appends the low length bits of code, length must not exceed 32
+	void Write(
+		uint32_t code,
+		uint32_t length)
+	{
+		acc = (acc << length) | code;
+		count += length;
+
+		if (count >= 32)
+		{
+			count -= 32;
+			uint32_t word = (uint32_t)(acc >> count);
+
+			out[0] = (uint8_t)(word >> 24);
+			out[1] = (uint8_t)(word >> 16);
+			out[2] = (uint8_t)(word >> 8);
+			out[3] = (uint8_t)word;
+			out += 4;
+		}
+	}
+
+	//Stores the remaining bits, the last byte is padded with zeros
+	void Flush()
+	{
+		while (count >= 8)
+		{
+			count -= 8;
+			*out++ = (uint8_t)(acc >> count);
+		}
+		if (count > 0)
+		{
+			*out++ = (uint8_t)(acc << (8 - count));
+			count = 0;
+		}
+	}
+};
+
+//Lookup table for canonical Huffman decoding, indexed by the next bits of the stream
+//as wide as the longest code. Entries hold the symbol in the low byte and the code
+//length in the high byte, 0 marks an unused code
+struct HuffDecodeTable
+{
+	uint8_t bits{};
+	vector<uint16_t> entries{};
+};
+
 struct NodeCompare
 {
 	bool operator()(
@@ -107,869 +320,4160 @@ struct NodeCompare
 	}
 };
 
-static void ForceClose(
-	const string& message,
-	ForceCloseType type);
-
-//Compress a single buffer into an already open stream
-static vector<uint8_t> CompressBuffer(
-	const vector<uint8_t>& input,
-	const string& origin);
+//Match candidate returned by the match finders
+struct Match
+{
+	size_t length;
+	size_t offset;
+};
 
-//Decompress from an already open stream into a buffer
-static void DecompressBuffer(
-	const vector<uint8_t>& lzssStream,
-	vector<uint8_t>& out,
-	size_t originalSize,
-	const string& target);
+//Hash-chain match finder, every position is hashed by its first MIN_MATCH bytes,
+//head stores the newest position per hash and prev links each position
+//to the previous one with the same hash. Positions are stored as pos + 1 so that 0 means empty
+struct HashChain
+{
+	vector<size_t> head;
+	vector<size_t> prev;
+	size_t hashShift;
+	size_t prevMask;
 
-//Recursively assign codes
-static void BuildCodes(
-	HuffNode* node,
-	const string& prefix,
-	map<uint8_t, string>& codes);
+	HashChain(size_t windowSize)
+	{
+		//bigger windows get bigger head tables to keep chains short, 4K-1M buckets
+		size_t hashBits = 12;
+		while (hashBits < 20
+			&& (static_cast<size_t>(1) << hashBits) < windowSize)
+		{
+			hashBits++;
+		}
+		head.assign(static_cast<size_t>(1) << hashBits, 0);
+		hashShift = 32 - hashBits;
+
+		//prev is a ring buffer at least as big as the window
+		size_t prevSize = 1;
+		while (prevSize < windowSize) prevSize <<= 1;
+		prev.assign(prevSize, 0);
+		prevMask = prevSize - 1;
+	}
 
-//Post-LZSS filter
-static vector<uint8_t> HuffmanEncode(
-	const vector<uint8_t>& input,
-	const string& origin);
+	size_t Hash(const uint8_t* data) const
+	{
+		uint32_t v = 
+			static_cast<uint32_t>(data[0])
+			| (static_cast<uint32_t>(data[1]) << 8)
+			| (static_cast<uint32_t>(data[2]) << 16);
 
-//Pre-LSZZ filter
-static vector<uint8_t> HuffmanDecode(
-	ifstream& in,
-	size_t storedSize,
-	const string& origin);
+		return (v * 2654435761u) >> hashShift;
+	}
 
-namespace KalaData
-{
-	void Compress::CompressToArchive(
-		const string& origin,
-		const string& target)
+	//Links pos into its hash chain, needs MIN_MATCH bytes after pos
+	void Insert(
+		span<const uint8_t> input,
+		size_t pos)
 	{
-		Command::SetCommandAllowState(false);
+		if (pos + MIN_MATCH > input.size()) return;
 
-		Core::PrintMessage(
-			"Starting to compress folder '" + origin + "' to archive '" + target + "'!\n");
+		size_t h = Hash(&input[pos]);
+		prev[pos & prevMask] = head[h];
+		head[h] = pos + 1;
+	}
 
-		//start clock timer
-		auto start = high_resolution_clock::now();
+	//Walks the chain of pos from the newest candidate backwards in window,
+	//every candidate longer than the previous best is added to matches
+	void Find(
+		span<const uint8_t> input,
+		size_t pos,
+		size_t windowSize,
+		size_t maxLength,
+		size_t maxChain,
+		vector<Match>& matches)
+	{
+		size_t bestLength = MIN_MATCH - 1;
+		size_t candidate = (pos + MIN_MATCH <= input.size())
+			? head[Hash(&input[pos])]
+			: 0;
 
-		ofstream out(target, ios::binary);
-		if (!out.is_open())
+		while (candidate != 0
+			&& maxChain-- > 0)
 		{
-			ForceClose(
-				"Failed to open target archive '" + target + "'!\n",
-				ForceCloseType::TYPE_COMPRESSION);
+			size_t i = candidate - 1;
+			if (pos - i > windowSize) break;
 
-			return;
-		}
+			//a candidate can only beat the best match if it also matches the byte after it
+			if (input[i + bestLength] == input[pos + bestLength])
+			{
+				size_t length = Simd::MatchLength(&input[i], &input[pos], maxLength);
 
-		//collect all files
-		vector<path> files{};
-		for (auto& p : recursive_directory_iterator(origin))
-		{
-			if (is_regular_file(p)) files.push_back(p.path());
-		}
+				if (length > bestLength)
+				{
+					bestLength = length;
+					matches.push_back({ length, pos - i });
 
-		if (files.empty())
-		{
-			ForceClose(
-				"Origin folder '" + origin + "' contains no valid files to compress!\n",
-				ForceCloseType::TYPE_COMPRESSION);
+					if (length == maxLength) break;
+				}
+			}
 
-			return;
+			candidate = prev[i & prevMask];
 		}
 
-		uint32_t compCount{};
-		uint32_t rawCount{};
-		uint32_t emptyCount{};
-
-		const char magicVer[6] = { 'K', 'D', 'A', 'T', KALADATA_VERSION[9], KALADATA_VERSION[11] };
-		out.write(magicVer, sizeof(magicVer));
-
-		if (Core::IsVerboseLoggingEnabled())
-		{
-			ostringstream ss{};
-
-			ss << "Window size is '" << WINDOW_SIZE << "'.\n"
-				<< "Lookahead is '" << LOOKAHEAD << "'.\n"
-				<< "Min match is '" << MIN_MATCH << "'.\n\n"
-				<< "Archive '" + target + "' version will be '" + string(magicVer, 6) + "'.\n";
+		Insert(input, pos);
+	}
+};
 
-			Core::PrintMessage(ss.str());
-		}
+//Binary-tree (BT4) match finder, positions sharing the same 4-byte hash
+//are kept in a binary search tree sorted by their suffix so that each lookup
+//walks one root-to-leaf path and returns every longer match on the way.
+//A small 3-byte hash table catches MIN_MATCH matches the 4-byte tree can't see.
+//The tree nodes live in a window-sized ring, two links (smaller, bigger) per position
+struct BinaryTree
+{
+	static constexpr size_t NICE_LENGTH = 64;
 
-		uint32_t fileCount = (uint32_t)files.size();
-		out.write((char*)&fileCount, sizeof(uint32_t));
+	vector<size_t> head3;
+	vector<size_t> head4;
+	vector<size_t> tree;
+	size_t hash4Shift;
+	size_t cyclicSize;
 
-		if (!out.good())
+	BinaryTree(size_t windowSize)
+	{
+		size_t hashBits = 12;
+		while (hashBits < 20
+			&& (static_cast<size_t>(1) << hashBits) < windowSize)
 		{
-			ForceClose(
-				"Failed to write file header data while building archive '" + target + "'!\n",
-				ForceCloseType::TYPE_COMPRESSION);
-
-			return;
+			hashBits++;
 		}
+		head4.assign(static_cast<size_t>(1) << hashBits, 0);
+		hash4Shift = 32 - hashBits;
 
-		for (auto& file : files)
-		{
-			//relative path
-			string relPath = relative(file, origin).string();
-			uint32_t pathLen = (uint32_t)relPath.size();
+		head3.assign(static_cast<size_t>(1) << 16, 0);
 
-			//read file into memory
-			ifstream in(file, ios::binary);
-			vector<uint8_t> raw((istreambuf_iterator<char>(in)), {});
-			in.close();
+		//offsets can reach the full window size so the ring holds one extra position
+		cyclicSize = windowSize + 1;
+		tree.assign(cyclicSize * 2, 0);
+	}
+
+	size_t Hash3(const uint8_t* data) const
+	{
+		uint32_t v =
+			static_cast<uint32_t>(data[0])
+			| (static_cast<uint32_t>(data[1]) << 8)
+			| (static_cast<uint32_t>(data[2]) << 16);
 
-			//compress directly into memory
-			vector<uint8_t> lszzData = CompressBuffer(raw, relPath);
+		return (v * 2654435761u) >> 16;
+	}
 
-			//wrap LZSS output with Huffman
-			vector<uint8_t> compData = HuffmanEncode(lszzData, origin);
+	size_t Hash4(const uint8_t* data) const
+	{
+		uint32_t v;
+		memcpy(&v, data, sizeof(uint32_t));
 
-			uint64_t originalSize = raw.size();
-			uint64_t compressedSize = compData.size();
+		return (v * 2654435761u) >> hash4Shift;
+	}
 
-			//safeguard: if compression is bigger or equal than original then store raw instead
-			bool useCompressed = compressedSize < originalSize;
-			const vector<uint8_t>& finalData = useCompressed ? compData : raw;
-			uint64_t finalSize = useCompressed ? compressedSize : originalSize;
+	//Inserts pos into the tree, if matches is not null then
+	//every match longer than the previous best is also added to it
+	void Update(
+		span<const uint8_t> input,
+		size_t pos,
+		size_t windowSize,
+		size_t maxLength,
+		size_t maxDepth,
+		vector<Match>* matches)
+	{
+		const uint8_t* cur = &input[pos];
+		size_t bestLength = MIN_MATCH - 1;
 
-			uint8_t method = useCompressed ? 1 : 0; //1 - LZSS, 0 = raw
+		if (maxLength >= MIN_MATCH)
+		{
+			size_t h3 = Hash3(cur);
+			size_t candidate = head3[h3];
+			head3[h3] = pos + 1;
 
-			if (!useCompressed)
+			if (matches
+				&& candidate != 0
+				&& pos - (candidate - 1) <= windowSize)
 			{
-				if (originalSize == 0)
-				{
-					emptyCount++;
+				const uint8_t* pb = &input[candidate - 1];
+				size_t length = Simd::MatchLength(pb, cur, maxLength);
 
-					if (Core::IsVerboseLoggingEnabled())
-					{
-						Core::PrintMessage(
-							"[EMPTY] '" + path(relPath).filename().string() + "'");
-					}
-				}
-				else
+				if (length > bestLength)
 				{
-					rawCount++;
+					bestLength = length;
+					matches->push_back({ length, pos - (candidate - 1) });
+				}
+			}
+		}
 
-					if (Core::IsVerboseLoggingEnabled())
-					{
-						ostringstream ss{};
+		//the last few bytes can't be hashed into the tree
+		if (maxLength < 4) return;
 
-						ss << "[RAW] '" << path(relPath).filename().string()
-							<< "' - '" << compressedSize << " bytes' "
-							<< ">= '" << originalSize << " bytes'";
+		//the tree is only sorted by the first NICE_LENGTH bytes,
+		//longer matches are extended past it once they are found
+		size_t treeLength = (maxLength < NICE_LENGTH) ? maxLength : NICE_LENGTH;
 
-						Core::PrintMessage(ss.str());
-					}
-				}
-			}
-			else
-			{
-				compCount++;
+		size_t h4 = Hash4(cur);
+		size_t candidate = head4[h4];
+		head4[h4] = pos + 1;
 
-				if (Core::IsVerboseLoggingEnabled())
-				{
-					ostringstream ss{};
+		size_t cyclicPos = pos % cyclicSize;
+		size_t* smaller = &tree[cyclicPos * 2];
+		size_t* bigger = &tree[cyclicPos * 2 + 1];
+		size_t smallerLength = 0;
+		size_t biggerLength = 0;
 
-					ss << "[COMPRESS] '" << path(relPath).filename().string()
-						<< "' - '" << compressedSize << " bytes' "
-						<< "< '" << originalSize << " bytes'";
+		while (true)
+		{
+			size_t delta = (candidate != 0) ? pos - (candidate - 1) : 0;
 
-					Core::PrintMessage(ss.str());
-				}
+			if (candidate == 0
+				|| delta > windowSize
+				|| maxDepth-- == 0)
+			{
+				*smaller = 0;
+				*bigger = 0;
+				return;
 			}
 
-			//write metadata
-			out.write((char*)&pathLen, sizeof(uint32_t));
-			out.write(relPath.data(), pathLen);
-			out.write((char*)&method, sizeof(uint8_t));
-			out.write((char*)&originalSize, sizeof(uint64_t));
-			out.write((char*)&finalSize, sizeof(uint64_t));
+			size_t* pair = &tree[(cyclicPos >= delta
+				? cyclicPos - delta
+				: cyclicPos - delta + cyclicSize) * 2];
+			const uint8_t* pb = cur - delta;
 
-			if (!out.good())
+			//everything below this node shares at least this many bytes with cur
+			size_t length = (smallerLength < biggerLength) ? smallerLength : biggerLength;
+			length += Simd::MatchLength(pb + length, cur + length, treeLength - length);
+
+			//full match, cur replaces this node and adopts its children
+			if (length == treeLength)
 			{
-				ForceClose(
-					"Failed to write metadata for file '" + relPath + "' while building archive '" + target + "'!\n",
-					ForceCloseType::TYPE_COMPRESSION);
+				length += Simd::MatchLength(pb + length, cur + length, maxLength - length);
+
+				if (matches
+					&& length > bestLength)
+				{
+					matches->push_back({ length, delta });
+				}
 
+				*smaller = pair[0];
+				*bigger = pair[1];
 				return;
 			}
 
-			//write compressed data if it is more than 0 bytes
-			if (finalSize > 0)
+			if (length > bestLength)
 			{
-				out.write((char*)finalData.data(), finalData.size());
-				if (!out.good())
-				{
-					ForceClose(
-						"Failed to write final data for file '" + relPath + "' while building archive '" + target + "'!\n",
-						ForceCloseType::TYPE_COMPRESSION);
+				bestLength = length;
+				if (matches) matches->push_back({ length, delta });
+			}
 
-					return;
-				}
+			if (pb[length] < cur[length])
+			{
+				*smaller = candidate;
+				smaller = &pair[1];
+				candidate = *smaller;
+				smallerLength = length;
+			}
+			else
+			{
+				*bigger = candidate;
+				bigger = &pair[0];
+				candidate = *bigger;
+				biggerLength = length;
 			}
 		}
+	}
+};
 
-		//finished writing
-		out.close();
+//The last offsets used by matches, most recent first. Matches that reuse
+//one of them are coded by its index instead of the full offset
+struct RepHistory
+{
+	static constexpr size_t COUNT = 3;
 
-		//end timer
-		auto end = high_resolution_clock::now();
-		auto durationSec = duration<double>(end - start).count();
+	uint32_t offsets[COUNT]{ 1, 2, 3 };
 
-		uint64_t folderSize{};
-		for (auto& p : recursive_directory_iterator(origin))
+	//Returns the index of offset, or COUNT if it is not a recent offset
+	size_t Find(size_t offset) const
+	{
+		for (size_t i = 0; i < COUNT; i++)
 		{
-			if (is_regular_file(p)) folderSize += file_size(p);
+			if (offsets[i] == offset) return i;
 		}
+		return COUNT;
+	}
 
-		auto archiveSize = file_size(target);
-		auto mbps = static_cast<double>(folderSize) / (1024.0 * 1024.0) / durationSec;
-
-		auto ratio = (static_cast<double>(archiveSize) / folderSize) * 100.0;
-		auto factor = static_cast<double>(folderSize) / archiveSize;
-		auto saved = 100.0 - ratio;
-
-		ostringstream finishComp{};
+	//Moves offset to the front, dropping the oldest offset if it was not recent
+	void Use(size_t offset)
+	{
+		size_t i = Find(offset);
+		if (i == COUNT) i = COUNT - 1;
 
-		if (Core::IsVerboseLoggingEnabled())
-		{
-			finishComp 
-				<< "Finished compressing folder '" << origin << "' to archive '" << target << "'!\n"
-				<< "  - origin folder size: " << folderSize << " bytes\n"
-				<< "  - target archive size: " << archiveSize << " bytes\n"
-				<< "  - compression ratio: " << fixed << setprecision(2) << ratio << "%\n"
-				<< "  - space saved: " << fixed << setprecision(2) << saved << "%\n"
-				<< "  - compression factor: " << fixed << setprecision(2) << factor << "x\n"
-				<< "  - throughput: " << fixed << setprecision(2) << mbps << " MB/s\n"
-				<< "  - total files: " << fileCount << "\n"
-				<< "  - compressed: " << compCount << "\n"
-				<< "  - stored raw: " << rawCount << "\n"
-				<< "  - empty: " << emptyCount << "\n"
-				<< "  - duration: " << fixed << setprecision(2) << durationSec << " seconds\n";
-		}
-		else
+		for (; i > 0; i--)
 		{
-			finishComp
-				<< "Finished compressing folder '" << path(origin).filename().string()
-				<< "' to archive '" << path(target).filename().string() << "'!\n"
-				<< "  - origin folder size: " << folderSize << " bytes\n"
-				<< "  - target archive size: " << archiveSize << " bytes\n"
-				<< "  - space saved: " << fixed << setprecision(2) << saved << "%\n"
-				<< "  - throughput: " << fixed << setprecision(2) << mbps << " MB/s\n"
-				<< "  - duration: " << fixed << setprecision(2) << durationSec << " seconds\n";
+			offsets[i] = offsets[i - 1];
 		}
+		offsets[0] = (uint32_t)offset;
+	}
+};
 
-		Core::PrintMessage(
-			finishComp.str(),
-			MessageType::MESSAGETYPE_SUCCESS);
+//Runs the match finder chosen by the current compression mode,
+//positions must be passed to Find or Skip in order, each exactly once
+struct MatchFinder
+{
+	span<const uint8_t> input;
+	size_t windowSize;
+	size_t lookAhead;
+	size_t maxChain;
+	unique_ptr<HashChain> chain;
+	unique_ptr<BinaryTree> tree;
+
+	MatchFinder(span<const uint8_t> data) :
+		input(data),
+		windowSize(Compress::GetWindowSize()),
+		lookAhead(Compress::GetLookAhead()),
+		maxChain(Compress::GetMaxChain())
+	{
+		if (Compress::GetMatchFinder() == MatchFinderType::MATCHFINDER_BINARY_TREE)
+		{
+			tree = make_unique<BinaryTree>(windowSize);
+		}
+		else chain = make_unique<HashChain>(windowSize);
+	}
 
-		Command::SetCommandAllowState(true);
+	size_t MaxLength(size_t pos) const
+	{
+		return (input.size() - pos < lookAhead)
+			? input.size() - pos
+			: lookAhead;
 	}
 
-	void Compress::DecompressToFolder(
-		const string& origin,
-		const string& target)
+	//Fills matches with candidates at pos sorted by increasing length
+	void Find(
+		size_t pos,
+		vector<Match>& matches)
 	{
-		Command::SetCommandAllowState(false);
+		matches.clear();
 
-		Core::PrintMessage(
-			"Starting to decompress archive '" + origin + "' to folder '" + target + "'!\n");
+		if (tree) tree->Update(input, pos, windowSize, MaxLength(pos), maxChain, &matches);
+		else chain->Find(input, pos, windowSize, MaxLength(pos), maxChain, matches);
+	}
 
-		//start clock timer
-		auto start = high_resolution_clock::now();
+	//Indexes pos without searching it
+	void Skip(size_t pos)
+	{
+		if (tree) tree->Update(input, pos, windowSize, MaxLength(pos), maxChain, nullptr);
+		else chain->Insert(input, pos);
+	}
 
-		ifstream in(origin, ios::binary);
-		if (!in.is_open())
+	//Returns the longest match at pos that reuses a recent offset,
+	//length is 0 if none of them reaches MIN_MATCH. Does not index pos
+	Match FindRep(
+		size_t pos,
+		const RepHistory& reps) const
+	{
+		Match best{ 0, 0 };
+
+		size_t maxLength = MaxLength(pos);
+		if (maxLength < MIN_MATCH) return best;
+
+		for (uint32_t offset : reps.offsets)
 		{
-			ForceClose(
-				"Failed to open origin archive '" + origin + "'!\n",
-				ForceCloseType::TYPE_DECOMPRESSION);
+			if (offset > pos) continue;
 
-			return;
+			size_t length = Simd::MatchLength(
+				&input[pos],
+				&input[pos - offset],
+				maxLength);
+
+			if (length >= MIN_MATCH
+				&& length > best.length)
+			{
+				best = { length, offset };
+			}
 		}
 
-		uint32_t compCount{};
-		uint32_t rawCount{};
-		uint32_t emptyCount{};
+		return best;
+	}
+};
 
-		//read magic number
-		char magicVer[6]{};
-		in.read(magicVer, sizeof(magicVer));
+static void ForceClose(
+	const string& message,
+	ForceCloseType type);
 
-		//check magic
-		if (memcmp(magicVer, "KDAT", 4) != 0)
+//Where a decoder puts its output. Whole outputs are held in memory and handed back once decoded,
+//streamed ones only hold the last STREAM_WINDOW bytes and write everything older to the target file
+//whenever the decoder runs out of room
+class OutputWindow
+{
+public:
+	explicit OutputWindow(size_t outputSize) :
+		size(outputSize),
+		capacity(outputSize)
+	{
+		//spare room at the end lets matches be copied in whole vector-sized chunks
+		buffer.resize(outputSize + COPY_SLACK);
+	}
+
+	//Writes the output to target starting at targetOffset, create creates the file or cuts it to zero length first
+	OutputWindow(
+		size_t outputSize,
+		const path& target,
+		uint64_t targetOffset,
+		bool create) :
+		size(outputSize),
+		capacity(STREAM_WINDOW + STREAM_FLUSH_SIZE),
+		filePath(target),
+		streamed(true)
+	{
+		buffer.resize(capacity + COPY_SLACK);
+
+		file.open(target, create
+			? ios::binary | ios::out | ios::trunc
+			: ios::binary | ios::in | ios::out);
+		file.seekp(static_cast<streamoff>(targetOffset));
+	}
+
+	//Returns where the length bytes at output position pos go, length must not exceed STREAM_FLUSH_SIZE.
+	//Returns nullptr if older output could not be written
+	uint8_t* Reserve(
+		size_t pos,
+		size_t length)
+	{
+		if (pos + length <= base + capacity) return buffer.data() + (pos - base);
+		return Slide(pos);
+	}
+
+	//Like Reserve, also fails if the match reaches back past the oldest byte still held.
+	//Streamed outputs never accept offsets beyond the window, so recent offsets stay readable after it slides
+	uint8_t* ReserveMatch(
+		size_t pos,
+		size_t offset,
+		size_t length,
+		const string& target)
+	{
+		uint8_t* dst = Reserve(pos, length);
+		if (dst != nullptr
+			&& (offset > pos - base
+			|| (streamed && offset > STREAM_WINDOW)))
 		{
 			ForceClose(
-				"Invalid magic value in archive '" + origin + "'!\n",
-				ForceCloseType::TYPE_DECOMPRESSION);
+				"Offset '" + to_string(offset) + "' reaches past the decoding window in '" + target + "' (corruption suspected)!\n",
+				ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
 
-			return;
+			return nullptr;
 		}
+		return dst;
+	}
 
-		//check version range
-		int version = stoi(string(magicVer + 4, 2));
-		if (version < 1
-			|| version > 99)
+	uint8_t At(size_t pos) const { return buffer[pos - base]; }
+
+	//Called by the decoder once all output is decoded, returns false if the rest could not be written
+	bool Finish()
+	{
+		if (streamed)
 		{
-			ForceClose(
-				"Out of range version '" + to_string(version) + "' in archive '" + origin + "'!\n",
-				ForceCloseType::TYPE_DECOMPRESSION);
+			if (!Flush(size)) return false;
 
-			return;
+			file.close();
+			if (file.fail())
+			{
+				ForceClose(
+					"Failed to write decompressed data to '" + filePath.string() + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION);
+
+				return false;
+			}
 		}
+		else buffer.resize(size);
 
-		//check version validity
+		finished = true;
+		return true;
+	}
 
-		char version_major = KALADATA_VERSION[9];
-		char version_minor = KALADATA_VERSION[11];
+	bool IsFinished() const { return finished; }
 
-		string thisVersion{ magicVer[4], magicVer[5] };
-		string requiredVersion{ version_major, version_minor };
+	//Whole outputs only: hands the decoded bytes to out, out stays empty if decoding did not finish
+	void TakeOutput(vector<uint8_t>& out)
+	{
+		if (finished) out = move(buffer);
+		else out.clear();
+	}
+private:
+	vector<uint8_t> buffer{};
+	size_t size{};
+	size_t capacity{};
 
-		if (thisVersion != requiredVersion)
-		{
-			ForceClose(
-				"Unsupported version '" + thisVersion + "' in archive '" + origin + "'! Version must be '" + requiredVersion + "'\n",
-				ForceCloseType::TYPE_DECOMPRESSION);
+	//output position of buffer[0]
+	size_t base{};
+	bool finished{};
 
-			return;
-		}
+	fstream file{};
+	path filePath{};
+	bool streamed{};
 
-		if (Core::IsVerboseLoggingEnabled())
+	//Writes out everything older than the window and moves the window to the front
+	uint8_t* Slide(size_t pos)
+	{
+		//whole outputs are sized to fit, the decoders bounds checks never let them get here
+		if (!streamed
+			|| pos - base < STREAM_WINDOW)
 		{
-			ostringstream ss{};
+			return nullptr;
+		}
 
-			ss << "Window size is '" << WINDOW_SIZE << "'.\n"
-				<< "Lookahead is '" << LOOKAHEAD << "'.\n"
-				<< "Min match is '" << MIN_MATCH << "'.\n\n"
-				<< "Archive '" + target + "' version is '" + string(magicVer, 6) + "'.\n";
+		size_t newBase = pos - STREAM_WINDOW;
+		if (!Flush(newBase)) return nullptr;
 
-			Core::PrintMessage(ss.str());
-		}
+		memmove(buffer.data(), buffer.data() + (newBase - base), pos - newBase);
+		base = newBase;
 
-		uint32_t fileCount{};
-		in.read((char*)&fileCount, sizeof(uint32_t));
-		if (fileCount > 100000)
-		{
-			ForceClose(
-				"Archive '" + origin + "' reports an absurd file count (corrupted?)!\n",
-				ForceCloseType::TYPE_DECOMPRESSION);
+		return buffer.data() + (pos - base);
+	}
 
-			return;
-		}
+	//Writes output from base up to end, the file position follows the output
+	bool Flush(size_t end)
+	{
+		file.write(
+			reinterpret_cast<const char*>(buffer.data()),
+			static_cast<streamsize>(end - base));
 
-		if (fileCount == 0)
+		if (!file.good())
 		{
 			ForceClose(
-				"Archive '" + origin + "' contains no valid files to decompress!\n",
+				"Failed to write decompressed data to '" + filePath.string() + "'!\n",
 				ForceCloseType::TYPE_DECOMPRESSION);
 
-			return;
+			return false;
 		}
+		return true;
+	}
+};
 
-		if (!in.good())
-		{
-			ForceClose(
-				"Unexpected EOF while reading header data in archive '" + origin + "'!\n",
-				ForceCloseType::TYPE_DECOMPRESSION);
+//Bytes held whole in memory, handed out one at a time to the decoders that also read streamed payloads
+class BufferSource
+{
+public:
+	explicit BufferSource(span<const uint8_t> bytes) :
+		bytes(bytes) {}
 
-			return;
-		}
+	//Returns false once every byte is taken
+	bool Take(uint8_t& byte)
+	{
+		if (pos >= bytes.size()) return false;
 
-		for (uint32_t i = 0; i < fileCount; i++)
-		{
-			uint32_t pathLen{};
-			in.read((char*)&pathLen, sizeof(uint32_t));
+		byte = bytes[pos++];
+		return true;
+	}
 
-			string relPath(pathLen, '\0');
-			in.read(relPath.data(), pathLen);
+	//Takes count bytes at once, returns false without taking any if fewer are left
+	bool Take(
+		uint8_t* dst,
+		size_t count)
+	{
+		if (count > bytes.size() - pos) return false;
 
-			uint8_t method{};
-			in.read((char*)&method, sizeof(uint8_t));
+		memcpy(dst, bytes.data() + pos, count);
+		pos += count;
+		return true;
+	}
 
-			uint64_t originalSize{};
-			in.read((char*)&originalSize, sizeof(uint64_t));
+	uint64_t GetRemaining() const { return bytes.size() - pos; }
+	bool IsDone() const { return pos == bytes.size(); }
+private:
+	span<const uint8_t> bytes{};
+	size_t pos{};
+};
 
-			uint64_t storedSize{};
-			in.read((char*)&storedSize, sizeof(uint64_t));
+//The stored bytes of a task read from the archive a piece at a time,
+//so a streamed task never holds more than STREAM_READ_SIZE of them
+class PayloadReader
+{
+public:
+	PayloadReader(
+		ifstream& archive,
+		uint64_t storedSize) :
+		archive(archive),
+		unread(storedSize) {}
+
+	//Returns false at the end of the stored bytes or if the archive can not be read
+	bool Take(uint8_t& byte)
+	{
+		if (pos == piece.size()
+			&& !Fill())
+		{
+			return false;
+		}
 
-			if (!in.good())
-			{
-				ForceClose(
-					"Unexpected EOF while reading metadata in archive '" + origin + "'!\n",
-					ForceCloseType::TYPE_DECOMPRESSION);
+		byte = piece[pos++];
+		return true;
+	}
 
-				return;
-			}
+	//Takes count bytes at once, returns false if the stored bytes end first
+	bool Take(
+		uint8_t* dst,
+		size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!Take(dst[i])) return false;
+		}
+		return true;
+	}
 
-			if (method == 0)
-			{
-				if (storedSize != originalSize)
-				{
-					ostringstream ss{};
+	uint64_t GetRemaining() const { return unread + (piece.size() - pos); }
+	bool IsDone() const { return GetRemaining() == 0; }
+private:
+	ifstream& archive;
+	uint64_t unread{};
 
-					ss << "Stored size '" << storedSize << "' for raw file '" << relPath << "' "
-						<< "is not the same as original size '" << originalSize << "' "
-						<< "in archive '" << target << "' (corruption suspected)!\n";
+	vector<uint8_t> piece{};
+	size_t pos{};
 
-					ForceClose(
-						ss.str(),
-						ForceCloseType::TYPE_DECOMPRESSION);
+	bool Fill()
+	{
+		size_t size = static_cast<size_t>(min<uint64_t>(unread, STREAM_READ_SIZE));
+		if (size == 0) return false;
 
-					return;
-				}
-			}
-			else if (method == 1)
-			{
-				if (storedSize >= originalSize)
-				{
-					ostringstream ss{};
+		piece.resize(size);
+		pos = 0;
 
-					ss << "Stored size '" << storedSize << "' for compressed file '" << relPath << "' "
-						<< "is the same or bigger than the original size '" << originalSize << "' "
-						<< "in archive '" << target << "' (corruption suspected)!\n";
+		archive.read(reinterpret_cast<char*>(piece.data()), static_cast<streamsize>(size));
+		if (archive.gcount() != static_cast<streamsize>(size))
+		{
+			piece.clear();
+			unread = 0;
+			return false;
+		}
 
-					ForceClose(
-						ss.str(),
-						ForceCloseType::TYPE_DECOMPRESSION);
+		unread -= size;
+		return true;
+	}
+};
 
-					return;
-				}
-			}
-			else
-			{
-				ForceClose(
-					"Unknown method storage flag '" + to_string(method) + "' in archive '" + origin + "'!\n",
-					ForceCloseType::TYPE_DECOMPRESSION);
+//Symbols of a tree coded Huffman payload, as version 01 archives store them,
+//decoded one at a time from the bytes of reader as the caller asks for them
+template <typename Reader>
+class TreeSource
+{
+public:
+	TreeSource(
+		Reader& reader,
+		const HuffNode* root,
+		size_t symbolCount) :
+		reader(reader),
+		root(root),
+		remaining(symbolCount) {}
+
+	//Returns false once every symbol is taken or if the bits run out first
+	bool Take(uint8_t& symbol)
+	{
+		if (remaining == 0) return false;
 
-				return;
+		//every code takes at least one bit, a tree always has two leaves
+		const HuffNode* node = root;
+		do
+		{
+			if (bit == 0)
+			{
+				if (!reader.Take(current)) return false;
+				bit = 8;
 			}
+			bit--;
 
-			if (originalSize == 0) emptyCount++;
-			else if (storedSize < originalSize) compCount++;
-			else rawCount++;
+			node = ((current >> bit) & 1) == 0 ? node->left.get() : node->right.get();
+		} while (node->left
+			|| node->right);
 
-			path outPath = path(target) / relPath;
-			create_directories(outPath.parent_path());
+		symbol = node->symbol;
+		remaining--;
+		return true;
+	}
 
-			//path traversal check
-			auto absTarget = weakly_canonical(target);
-			auto absOut = weakly_canonical(outPath);
+	//Takes count symbols at once, returns false if the bits run out first
+	bool Take(
+		uint8_t* dst,
+		size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!Take(dst[i])) return false;
+		}
+		return true;
+	}
 
-			if (absOut.string().find(absTarget.string()) != 0)
-			{
-				ForceClose(
-					"Archive '" + origin + "' contains invalid path '" + relPath + "' (path traveral attempt)!",
-					ForceCloseType::TYPE_DECOMPRESSION);
+	bool IsDone() const { return remaining == 0; }
+private:
+	Reader& reader;
+	const HuffNode* root{};
+	size_t remaining{};
 
-				return;
-			}
+	uint8_t current{};
+	int bit{};
+};
 
-			//prepare output buffer
-			vector<uint8_t> data{};
-			auto storedStart = in.tellg();
+//Compress one chunk that has already been read
+static void CompressChunk(
+	const ArchiveEntry& entry,
+	ArchiveChunk& chunk);
 
-			//raw: copy exactly storedSize bytes
-			if (method == 0)
-			{
-				if (storedSize == 0
-					&& Core::IsVerboseLoggingEnabled())
-				{
-					Core::PrintMessage(
-						"[EMPTY] '" + path(relPath).filename().string() + "'");
-				}
-				else
-				{
-					if (Core::IsVerboseLoggingEnabled())
-					{
-						ostringstream ss{};
+//Compress a single buffer into split streams, each stream is coded
+//with whichever of Huffman and tANS comes out smaller
+static vector<uint8_t> CompressBuffer(
+	span<const uint8_t> input,
+	const string& origin);
 
-						ss << "[RAW] '" << path(relPath).filename().string()
-							<< "' - '" << storedSize << " bytes' "
-							<< ">= '" << originalSize << " bytes'";
+//Returns true if every sampled slice of the input looks random, so running the compressor
+//on it would only waste time. Known compressed formats are trusted after a single slice
+static bool IsIncompressible(span<const uint8_t> input);
 
-						Core::PrintMessage(ss.str());
-					}
+//Returns true if the input starts with the signature of a format whose payload is already entropy coded
+static bool HasCompressedSignature(span<const uint8_t> input);
 
-					data.resize(static_cast<size_t>(storedSize));
-					if (!in.read((char*)data.data(), static_cast<streamsize>(storedSize)))
-					{
-						ForceClose(
-							"Unexpected end of archive while reading raw data for '" + relPath + "' in archive '" + origin + "'!\n",
-							ForceCloseType::TYPE_DECOMPRESSION);
+//Returns true if the slice has near 8 bits of order-0 entropy per byte and almost no 4-byte repeats
+static bool IsRandomSlice(
+	const uint8_t* data,
+	size_t size);
 
-						return;
-					}
-				}
-			}
-			//LZSS: decompress storedSize to originalSize
-			else if (method == 1)
-			{
-				if (Core::IsVerboseLoggingEnabled())
-				{
-					ostringstream ss{};
+//Append a 4-byte stream size and the stream bytes
+static void AppendStream(
+	vector<uint8_t>& output,
+	const vector<uint8_t>& stream);
 
-					ss << "[DECOMPRESS] '" << path(relPath).filename().string()
-						<< "' - '" << storedSize << " bytes' "
-						<< "< '" << originalSize << " bytes'";
+//Decompress split streams into a buffer,
+//tagged streams start with the id of the coder that wrote them
+static void DecompressStreams(
+	const vector<uint8_t>& payload,
+	OutputWindow& out,
+	size_t originalSize,
+	bool tagged,
+	const string& target);
 
-					Core::PrintMessage(ss.str());
-				}
+//Decompress tokens coded by the adaptive range coder into a buffer
+static void DecompressAdaptive(
+	const vector<uint8_t>& payload,
+	OutputWindow& out,
+	size_t originalSize,
+	const string& target);
 
-				vector<uint8_t> lzssStream = HuffmanDecode(
-					in,
-					static_cast<size_t>(storedSize),
-					origin);
-
-				//decompress
-				DecompressBuffer(
-					lzssStream,
-					data,
-					static_cast<size_t>(originalSize),
-					origin);
-			}
+//Read the chunk table of a method 5 entry at the current archive position
+//and add a task for every chunk, returns false if the table is damaged
+static bool AddChunkTasks(
+	ifstream& in,
+	const ExtractTask& entry,
+	vector<ExtractTask>& tasks,
+	const string& origin);
 
-			//sanity check
-			if (data.size() != originalSize)
+//Read the stored bytes of count tasks from the archive in one batch, decode them and
+//write them to their place in the extracted files in another, returns false on failure
+static bool ExtractParts(
+	const vector<ExtractTask>& tasks,
+	size_t first,
+	size_t count,
+	int version,
+	const string& origin);
+
+//Decode the stored bytes of a task, returns false if they do not decode to its original size
+static bool DecodePart(
+	const ExtractTask& task,
+	vector<uint8_t>& payload,
+	vector<uint8_t>& data,
+	int version,
+	const string& origin);
+
+//Extract a task too large to hold in memory, its output is written to the file
+//in pieces while it is decoded, returns false on failure
+static bool ExtractStreamed(
+	const ExtractTask& task,
+	int version,
+	const string& origin);
+
+//Decode the stored bytes of a compressed task into out
+static void DecodeStored(
+	const ExtractTask& task,
+	const vector<uint8_t>& payload,
+	OutputWindow& out,
+	int version,
+	const string& origin);
+
+//Verbose summary lines on how input and output files were read and written
+static string DescribeFileIO();
+
+//Decompress the LZSS token stream taken from tokens into out,
+//version is the archive version the stream was written with
+template <typename Source>
+static void DecompressTokens(
+	Source& tokens,
+	OutputWindow& out,
+	size_t originalSize,
+	int version,
+	const string& target);
+
+//Decode version 1 tokens: a flag byte per token, 4-byte offsets and 1-byte lengths
+template <typename Source>
+static bool DecodeLegacyTokens(
+	Source& tokens,
+	OutputWindow& out,
+	size_t originalSize,
+	size_t& written,
+	const string& target);
+
+//Decode packed tokens: 8 flags per control byte, 1-byte lengths and varint offsets
+template <typename Source>
+static bool DecodePackedTokens(
+	Source& tokens,
+	OutputWindow& out,
+	size_t originalSize,
+	size_t& written,
+	const string& target);
+
+//Check that a match points into already decoded data and fits the output
+static bool IsValidMatch(
+	size_t offset,
+	size_t length,
+	size_t written,
+	size_t originalSize,
+	const string& target);
+
+//Build a Huffman tree from symbol frequencies, returns nullptr if there are no symbols
+static unique_ptr<HuffNode> BuildTree(const size_t freq[256]);
+
+//Recursively assign code lengths
+static void BuildCodeLengths(
+	HuffNode* node,
+	uint8_t depth,
+	uint8_t lengths[256]);
+
+//Optimal Huffman code lengths from symbol frequencies, no longer than maxLength
+static void BuildLimitedCodeLengths(
+	const size_t freq[256],
+	uint8_t lengths[256],
+	uint8_t maxLength);
+
+//Assign canonical codes from code lengths
+static void BuildCanonicalCodes(
+	const uint8_t lengths[256],
+	uint16_t codes[256]);
+
+//Build lookup tables from code lengths, returns false if the lengths are not a valid prefix code
+static bool BuildDecodeTable(
+	const uint8_t lengths[256],
+	HuffDecodeTable& table);
+
+//Post-LZSS filter
+static vector<uint8_t> HuffmanEncode(
+	const vector<uint8_t>& input,
+	const string& origin);
+
+//Encode input in blocks of Compress::GetBlockSize() symbols, each block gets its own
+//table unless reusing the table of the block before it is cheaper
+static vector<uint8_t> HuffmanEncodeBlocked(
+	const vector<uint8_t>& input,
+	const string& origin);
+
+//Number of bits symbols with these frequencies take with these code lengths,
+//UINT64_MAX if a used symbol has no code
+static uint64_t CodedBits(
+	const size_t freq[256],
+	const uint8_t lengths[256]);
+
+//Append the code lengths up to the highest used symbol, two 4-bit lengths per byte,
+//returns false if there are no symbols
+static bool WriteCodeLengths(
+	const uint8_t lengths[256],
+	vector<uint8_t>& output);
+
+//Read code lengths written by WriteCodeLengths, returns false if the data ends first
+static bool ReadCodeLengths(
+	const uint8_t* data,
+	size_t size,
+	size_t& pos,
+	uint8_t lengths[256]);
+
+//Append count symbols as one bitstream, or as interleaved bitstreams
+//behind a jump table once there are INTERLEAVE_MIN_SYMBOLS of them
+static bool WriteBitstreams(
+	const uint8_t* symbols,
+	size_t count,
+	const uint8_t lengths[256],
+	const uint16_t codes[256],
+	vector<uint8_t>& output,
+	const string& origin);
+
+//Decodes one symbol, returns false on an unused code or if the stream ran out
+static bool DecodeSymbol(
+	BitReader& reader,
+	const HuffDecodeTable& table,
+	uint8_t& symbol);
+
+//Decode count symbols from bitstreams written by WriteBitstreams that take up exactly size bytes
+static bool DecodeBitstreams(
+	const uint8_t* data,
+	size_t size,
+	const HuffDecodeTable& table,
+	bool interleaved,
+	uint8_t* out,
+	size_t count,
+	const string& origin);
+
+//Pre-LSZZ filter
+static vector<uint8_t> HuffmanDecode(
+	const uint8_t* data,
+	size_t size,
+	const string& origin);
+
+//Read the symbol frequencies of a tree coded payload in the dense or sparse mode and rebuild its tree,
+//symbolCount is the number of symbols coded with it. Returns nullptr if the table is damaged
+template <typename Reader>
+static unique_ptr<HuffNode> ReadHuffmanTree(
+	Reader& reader,
+	uint8_t mode,
+	size_t& symbolCount,
+	const string& origin);
+
+//Decode a canonical Huffman payload that follows the mode byte,
+//interleaved payloads hold several bitstreams behind a jump table
+static vector<uint8_t> HuffmanDecodeCanonical(
+	const uint8_t* data,
+	size_t size,
+	bool interleaved,
+	const string& origin);
+
+//Decode a blocked Huffman payload that follows the mode byte
+static vector<uint8_t> HuffmanDecodeBlocked(
+	const uint8_t* data,
+	size_t size,
+	const string& origin);
+
+//LZSS tokens split by kind, each stream is entropy coded on its own
+struct TokenStreams
+{
+	//one bit per token (lowest first), set for a match
+	vector<uint8_t> control{};
+	vector<uint8_t> literals{};
+	//match length - MIN_MATCH
+	vector<uint8_t> lengths{};
+	//recent offset index of each match, or REP_CODES + its offset bucket, see OffsetCode
+	vector<uint8_t> offsetCodes{};
+	//low offset bits below each bucket, packed MSB first
+	vector<uint8_t> extraBits{};
+};
+
+//Offset codes below this select a recent offset, see RepHistory
+constexpr uint8_t REP_CODES = (uint8_t)RepHistory::COUNT;
+
+//Splits offset - 1 into a bucket code and the extra bits that select
+//the offset inside it. Values below 4 are their own code, larger values
+//get two codes per power of two keyed by the bit below the top bit
+static void OffsetCode(
+	uint32_t value,
+	uint8_t& code,
+	uint8_t& extraCount,
+	uint32_t& extra)
+{
+	if (value < 4)
+	{
+		code = (uint8_t)value;
+		extraCount = 0;
+		extra = 0;
+		return;
+	}
+
+	uint8_t topBit = (uint8_t)(bit_width(value) - 1);
+
+	extraCount = topBit - 1;
+	code = (uint8_t)(2 * topBit + ((value >> extraCount) & 1));
+	extra = value & ((1u << extraCount) - 1);
+}
+
+//Writes LZSS tokens into split streams. Also counts every written symbol
+//per stream so that the optimal parser can price tokens by their Huffman code length
+struct TokenWriter
+{
+	TokenStreams& streams;
+
+	size_t literalFreq[256]{};
+	size_t lengthFreq[256]{};
+	size_t offsetFreq[256]{};
+
+	uint8_t literalBits[256]{};
+	uint8_t lengthBits[256]{};
+	uint8_t offsetBits[256]{};
+
+	RepHistory reps{};
+
+	uint8_t controlBit = 8;
+
+	uint32_t extraBuf = 0;
+	uint8_t extraCount = 0;
+
+	TokenWriter(TokenStreams& s) : streams(s) {}
+
+	void Literal(uint8_t c)
+	{
+		NextControlBit();
+
+		streams.literals.push_back(c);
+		literalFreq[c]++;
+	}
+
+	void Match(
+		size_t offset,
+		size_t length)
+	{
+		streams.control.back() |= (uint8_t)(1u << NextControlBit());
+
+		uint8_t len8 = (uint8_t)(length - MIN_MATCH);
+		streams.lengths.push_back(len8);
+		lengthFreq[len8]++;
+
+		size_t repIndex = reps.Find(offset);
+		reps.Use(offset);
+
+		if (repIndex != RepHistory::COUNT)
+		{
+			streams.offsetCodes.push_back((uint8_t)repIndex);
+			offsetFreq[repIndex]++;
+			return;
+		}
+
+		uint8_t code{};
+		uint8_t count{};
+		uint32_t extra{};
+		OffsetCode((uint32_t)(offset - 1), code, count, extra);
+
+		code += REP_CODES;
+		streams.offsetCodes.push_back(code);
+		offsetFreq[code]++;
+
+		//extra bits never exceed 30, so at most 7 pending bits plus 30 new ones
+		//are split into two writes to keep them inside the 32-bit buffer
+		if (count > 16)
+		{
+			WriteExtra(extra >> 16, count - 16);
+			WriteExtra(extra & 0xFFFF, 16);
+		}
+		else WriteExtra(extra, count);
+	}
+
+	//Pads the last extra bits byte with zeros
+	void Finish()
+	{
+		if (extraCount > 0)
+		{
+			streams.extraBits.push_back((uint8_t)(extraBuf << (8 - extraCount)));
+			extraBuf = 0;
+			extraCount = 0;
+		}
+	}
+
+	//Rebuilds the price of every symbol from the symbols written so far,
+	//unseen symbols get a count of 1 so every symbol stays priced
+	void UpdatePrices()
+	{
+		UpdateStreamPrices(literalFreq, literalBits);
+		UpdateStreamPrices(lengthFreq, lengthBits);
+		UpdateStreamPrices(offsetFreq, offsetBits);
+	}
+
+	//Every token also pays one bit of its control byte
+	uint32_t LiteralPrice(uint8_t c) const
+	{
+		return 1 + literalBits[c];
+	}
+
+	//Prices a match as if written after the given recent offsets
+	uint32_t MatchPrice(
+		size_t offset,
+		size_t length,
+		const RepHistory& history) const
+	{
+		uint32_t price = 1 + lengthBits[(length - MIN_MATCH) & 0xFF];
+
+		size_t repIndex = history.Find(offset);
+		if (repIndex != RepHistory::COUNT) return price + offsetBits[repIndex];
+
+		uint8_t code{};
+		uint8_t count{};
+		uint32_t extra{};
+		OffsetCode((uint32_t)(offset - 1), code, count, extra);
+
+		return price + offsetBits[code + REP_CODES] + count;
+	}
+
+private:
+	//Starts a new control byte every 8 tokens and returns the bit of the next token
+	uint8_t NextControlBit()
+	{
+		if (controlBit == 8)
+		{
+			streams.control.push_back(0);
+			controlBit = 0;
+		}
+		return controlBit++;
+	}
+
+	void WriteExtra(
+		uint32_t value,
+		uint8_t count)
+	{
+		extraBuf = (extraBuf << count) | value;
+		extraCount += count;
+
+		while (extraCount >= 8)
+		{
+			extraCount -= 8;
+			streams.extraBits.push_back((uint8_t)(extraBuf >> extraCount));
+		}
+		extraBuf &= (1u << extraCount) - 1;
+	}
+
+	static void UpdateStreamPrices(
+		const size_t freq[256],
+		uint8_t bits[256])
+	{
+		size_t smoothed[256]{};
+		for (int i = 0; i < 256; i++) smoothed[i] = freq[i] + 1;
+
+		unique_ptr<HuffNode> root = BuildTree(smoothed);
+		BuildCodeLengths(root.get(), 0, bits);
+	}
+};
+
+//Adaptive contexts for LZSS tokens coded by the range coder, the encoder
+//and decoder build the same model and update it after every token
+struct TokenModel
+{
+	LiteralModel literals;
+
+	//literal or match, keyed by the kinds of the last 3 tokens
+	BitModel isMatch[8]{};
+
+	//match length - MIN_MATCH, keyed by whether the previous token was a match
+	BitTree<8> lengths[2]{};
+
+	//offset codes, keyed by the match length up to 3 + MIN_MATCH
+	BitTree<7> offsetCodes[4]{};
+
+	//extra bits of the buckets with fewer than 4 of them, one tree per bucket
+	BitTree<3> shortExtra[6]{};
+
+	//lowest 4 extra offset bits, the bits above them are close to random
+	BitTree<4> align{};
+
+	//kinds of the last 3 tokens, lowest bit is the latest, set for a match
+	uint32_t state = 0;
+
+	TokenModel(size_t size) : literals(Order2Bits(size)) {}
+
+	//Small files get a small order-2 table, large ones get up to 4M entries
+	static uint8_t Order2Bits(size_t size)
+	{
+		size_t bits = bit_width(size) + 4;
+		if (bits < 16) bits = 16;
+		if (bits > 22) bits = 22;
+
+		return (uint8_t)bits;
+	}
+};
+
+//Codes the tokens of already parsed split streams with the adaptive range coder
+static vector<uint8_t> EncodeAdaptive(
+	span<const uint8_t> input,
+	const TokenStreams& streams);
+
+//Finds the match to take at pos and indexes pos. Recent offsets are tried first
+//and the window search is skipped when one of them already reaches niceLength
+static Match FindBestMatch(
+	MatchFinder& finder,
+	const RepHistory& reps,
+	size_t pos,
+	size_t niceLength,
+	vector<Match>& matches);
+
+//Takes the longest match at every position
+static void ParseGreedy(
+	span<const uint8_t> input,
+	MatchFinder& finder,
+	TokenWriter& writer);
+
+//Takes the longest match unless the match at the next position is longer,
+//in which case the current byte is written as a literal first
+static void ParseLazy(
+	span<const uint8_t> input,
+	MatchFinder& finder,
+	TokenWriter& writer);
+
+//Picks the cheapest token path through each block by dynamic programming
+//over all match candidates, priced by the Huffman code lengths of earlier output
+static void ParseOptimal(
+	span<const uint8_t> input,
+	MatchFinder& finder,
+	TokenWriter& writer);
+
+namespace KalaData
+{
+	void Compress::CompressToArchive(
+		const string& origin,
+		const string& target)
+	{
+		Command::SetCommandAllowState(false);
+
+		Core::PrintMessage(
+			"Starting to compress folder '" + origin + "' to archive '" + target + "'!\n");
+
+		//start clock timer
+		auto start = high_resolution_clock::now();
+		FileIO::ResetStats();
+		MappedFile::ResetStats();
+
+		ofstream out(target, ios::binary);
+		if (!out.is_open())
+		{
+			ForceClose(
+				"Failed to open target archive '" + target + "'!\n",
+				ForceCloseType::TYPE_COMPRESSION);
+
+			return;
+		}
+
+		//collect all files
+		vector<path> files{};
+		for (auto& p : recursive_directory_iterator(origin))
+		{
+			if (is_regular_file(p)) files.push_back(p.path());
+		}
+
+		if (files.empty())
+		{
+			ForceClose(
+				"Origin folder '" + origin + "' contains no valid files to compress!\n",
+				ForceCloseType::TYPE_COMPRESSION);
+
+			return;
+		}
+
+		uint32_t compCount{};
+		uint32_t rawCount{};
+		uint32_t skipCount{};
+		uint32_t emptyCount{};
+
+		const char magicVer[6] = { 'K', 'D', 'A', 'T', KALADATA_VERSION[9], KALADATA_VERSION[11] };
+		out.write(magicVer, sizeof(magicVer));
+
+		if (Core::IsVerboseLoggingEnabled())
+		{
+			ostringstream ss{};
+
+			ss << "Window size is '" << WINDOW_SIZE << "'.\n"
+				<< "Lookahead is '" << LOOKAHEAD << "'.\n"
+				<< "Max chain depth is '" << MAX_CHAIN << "'.\n"
+				<< "Min match is '" << MIN_MATCH << "'.\n"
+				<< "Match kernel is '" << Simd::GetLevelName() << "'.\n\n"
+				<< "Archive '" + target + "' version will be '" + string(magicVer, 6) + "'.\n";
+
+			Core::PrintMessage(ss.str());
+		}
+
+		uint32_t fileCount = (uint32_t)files.size();
+		out.write((char*)&fileCount, sizeof(uint32_t));
+
+		if (!out.good())
+		{
+			ForceClose(
+				"Failed to write file header data while building archive '" + target + "'!\n",
+				ForceCloseType::TYPE_COMPRESSION);
+
+			return;
+		}
+
+		//files larger than the chunk size are split into chunks that are compressed
+		//independently, so one large file can keep every worker busy
+		uint64_t chunkSize = GetChunkSize();
+
+		vector<ArchiveEntry> entries(files.size());
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			ArchiveEntry& entry = entries[i];
+			entry.file = files[i];
+			entry.relPath = relative(files[i], origin).string();
+			entry.size = file_size(files[i]);
+
+			//smaller files and empty files are a single chunk
+			uint64_t step = chunkSize;
+			if (step == 0 && entry.size > IN_FLIGHT_LIMIT) step = CHUNK_SIZE_MAX;
+			if (step == 0 || entry.size <= step) step = entry.size;
+
+			entry.chunkSize = step;
+
+			uint64_t offset = 0;
+			do
+			{
+				ArchiveChunk& chunk = entry.chunks.emplace_back();
+				chunk.offset = offset;
+				chunk.size = (entry.size - offset < step) ? entry.size - offset : step;
+
+				offset += step;
+			} while (offset < entry.size);
+		}
+
+		//largest files go first so a big file is never the last task left running while every
+		//other worker idles, the archive keeps this order so the writer does not wait on it either
+		stable_sort(
+			entries.begin(),
+			entries.end(),
+			[](const ArchiveEntry& a, const ArchiveEntry& b) { return a.size > b.size; });
+
+		//one chunk of one file, handed from stage to stage
+		struct ChunkTask
+		{
+			ArchiveEntry* entry;
+			ArchiveChunk* chunk;
+		};
+		size_t taskCount = 0;
+		for (const auto& entry : entries) taskCount += entry.chunks.size();
+
+		size_t threadCount = GetThreadCount();
+		if (threadCount > taskCount) threadCount = taskCount;
+
+		//the archive is built by three stages that overlap: a reader thread reads chunks in archive order,
+		//compression workers compress them and this thread writes finished entries in archive order.
+		//The stages hand chunks over through lock-free queues, the reader stops reading ahead
+		//once IN_FLIGHT_LIMIT bytes are read but not yet written
+		vector<unique_ptr<BoundedQueue<ChunkTask>>> queues{};
+		for (size_t i = 0; i < threadCount; i++)
+		{
+			queues.push_back(make_unique<BoundedQueue<ChunkTask>>(WORKER_QUEUE_SIZE));
+		}
+		BoundedQueue<ChunkTask> finished(WRITER_QUEUE_SIZE);
+
+		//taskReady: a chunk was queued for the workers, chunkDone: a chunk was queued for the writer,
+		//spaceFreed: a queue slot or in-flight bytes were freed
+		WaitSignal taskReady{};
+		WaitSignal chunkDone{};
+		WaitSignal spaceFreed{};
+
+		atomic<uint64_t> inFlight = 0;
+		atomic<bool> stopping = false;
+
+		//time each worker spent compressing and how many tasks it ran, read once the workers are joined
+		struct WorkerStats
+		{
+			double busy;
+			size_t tasks;
+			size_t stolen;
+		};
+		vector<WorkerStats> stats(threadCount);
+		double readSeconds{};
+		double writeSeconds{};
+
+		//a worker takes from its own queue first and steals from the others once it runs dry
+		auto TakeTask = [&](size_t self, ChunkTask& task)
+			{
+				for (size_t i = 0; i < queues.size(); i++)
+				{
+					if (queues[(self + i) % queues.size()]->TryPop(task))
+					{
+						if (i != 0) stats[self].stolen++;
+						return true;
+					}
+				}
+				return false;
+			};
+
+		//chunks are read in batches of up to IO_BATCH_FILES requests or IO_BATCH_BYTES,
+		//so many small files cost a few system calls instead of a few per file
+		vector<FileRequest> batch{};
+		vector<ChunkTask> batchTasks{};
+		uint64_t batchBytes = 0;
+		size_t dealt = 0;
+
+		size_t mappedChunks = 0;
+		uint64_t mappedBytes = 0;
+
+		//chunks are dealt out to the worker queues in turn, skipping full ones
+		auto DealTask = [&](const ChunkTask& task)
+			{
+				while (true)
+				{
+					uint32_t seen = spaceFreed.Prepare();
+
+					bool pushed = false;
+					for (size_t i = 0; i < queues.size() && !pushed; i++)
+					{
+						pushed = queues[(dealt + i) % queues.size()]->TryPush(task);
+					}
+					if (pushed) break;
+					if (stopping) return false;
+
+					spaceFreed.Wait(seen);
+				}
+				dealt++;
+				taskReady.Notify();
+				return true;
+			};
+
+		auto ReadBatch = [&]()
+			{
+				if (batch.empty()) return true;
+
+				auto readStart = high_resolution_clock::now();
+				FileIO::ReadBatch(batch);
+				readSeconds += duration<double>(high_resolution_clock::now() - readStart).count();
+
+				for (size_t r = 0; r < batch.size(); r++)
+				{
+					//a file that shrank or vanished since it was listed only yields what is left of it,
+					//which the writer only accepts for files stored in one piece
+					ArchiveChunk& chunk = *batchTasks[r].chunk;
+					chunk.raw.resize(static_cast<size_t>(batch[r].transferred));
+					chunk.input = chunk.raw;
+
+					if (!DealTask(batchTasks[r])) return false;
+				}
+
+				batch.clear();
+				batchTasks.clear();
+				batchBytes = 0;
+				return true;
+			};
+
+		auto Reader = [&]()
+			{
+				for (auto& entry : entries)
+				{
+					for (auto& chunk : entry.chunks)
+					{
+						//a single chunk larger than the limit is still read once nothing else is in flight,
+						//chunks read so far are handed on before waiting so the workers never wait on them
+						while (true)
+						{
+							uint32_t seen = spaceFreed.Prepare();
+							uint64_t current = inFlight.load();
+
+							if (current == 0
+								|| current + chunk.size <= IN_FLIGHT_LIMIT)
+							{
+								break;
+							}
+							if (!ReadBatch()) return;
+							if (stopping) return;
+
+							spaceFreed.Wait(seen);
+						}
+						inFlight += chunk.size;
+
+						//large chunks are compressed from a mapping of their file, which the kernel
+						//reads ahead while the chunk waits for a worker. Files that can not be mapped are read
+						if (chunk.size >= MAP_MIN_SIZE)
+						{
+							auto mapStart = high_resolution_clock::now();
+							auto mapped = make_unique<MappedFile>();
+							bool isMapped = mapped->Open(entry.file, chunk.offset, chunk.size);
+							readSeconds += duration<double>(high_resolution_clock::now() - mapStart).count();
+
+							if (isMapped)
+							{
+								chunk.input = mapped->GetData();
+								chunk.mapped = move(mapped);
+
+								mappedChunks++;
+								mappedBytes += chunk.size;
+
+								if (!DealTask({ &entry, &chunk })) return;
+								continue;
+							}
+						}
+
+						chunk.raw.resize(static_cast<size_t>(chunk.size));
+
+						FileRequest& request = batch.emplace_back();
+						request.file = entry.file;
+						request.offset = chunk.offset;
+						request.data = chunk.raw.data();
+						request.size = chunk.size;
+
+						batchTasks.push_back({ &entry, &chunk });
+						batchBytes += chunk.size;
+
+						if (batch.size() >= IO_BATCH_FILES
+							|| batchBytes >= IO_BATCH_BYTES)
+						{
+							if (!ReadBatch()) return;
+						}
+					}
+				}
+				ReadBatch();
+			};
+
+		auto Worker = [&](size_t self)
+			{
+				while (!stopping)
+				{
+					uint32_t seen = taskReady.Prepare();
+
+					ChunkTask task{};
+					if (!TakeTask(self, task))
+					{
+						taskReady.Wait(seen);
+						continue;
+					}
+					spaceFreed.Notify();
+
+					auto taskStart = high_resolution_clock::now();
+
+					ArchiveChunk& chunk = *task.chunk;
+					CompressChunk(*task.entry, chunk);
+
+					//a mapped chunk stored raw is copied out so the writer never reads the mapping.
+					//A file cut short under its mapping reads as zeros from there on, so then
+					//the chunk is read again the usual way and compressed from what is left of it
+					if (chunk.mapped)
+					{
+						bool isRaw = chunk.skipped
+							|| chunk.compData.size() >= chunk.input.size();
+
+						if (isRaw) chunk.raw.assign(chunk.input.begin(), chunk.input.end());
+
+						if (chunk.mapped->IsFaulted())
+						{
+							chunk.input = {};
+							chunk.mapped.reset();
+							chunk.compData = vector<uint8_t>();
+							chunk.raw.resize(static_cast<size_t>(chunk.size));
+
+							vector<FileRequest> request(1);
+							request[0].file = task.entry->file;
+							request[0].offset = chunk.offset;
+							request[0].data = chunk.raw.data();
+							request[0].size = chunk.size;
+
+							FileIO::ReadBatch(request);
+
+							chunk.raw.resize(static_cast<size_t>(request[0].transferred));
+							chunk.input = chunk.raw;
+							CompressChunk(*task.entry, chunk);
+						}
+						else if (isRaw)
+						{
+							chunk.input = chunk.raw;
+							chunk.mapped.reset();
+						}
+					}
+					stats[self].busy += duration<double>(high_resolution_clock::now() - taskStart).count();
+					stats[self].tasks++;
+
+					while (!finished.TryPush(task))
+					{
+						uint32_t spaceSeen = spaceFreed.Prepare();
+						if (finished.TryPush(task)) break;
+						if (stopping) return;
+
+						spaceFreed.Wait(spaceSeen);
+					}
+					chunkDone.Notify();
+				}
+			};
+
+		auto poolStart = high_resolution_clock::now();
+		double poolSeconds{};
+
+		thread reader(Reader);
+
+		vector<thread> workers{};
+		for (size_t i = 0; i < threadCount; i++) workers.emplace_back(Worker, i);
+
+		auto StopWorkers = [&]()
+			{
+				stopping = true;
+				taskReady.Notify();
+				chunkDone.Notify();
+				spaceFreed.Notify();
+
+				reader.join();
+				for (auto& worker : workers) worker.join();
+
+				poolSeconds = duration<double>(high_resolution_clock::now() - poolStart).count();
+			};
+
+		if (Core::IsVerboseLoggingEnabled())
+		{
+			Core::PrintMessage(
+				"Compressing with '" + to_string(threadCount) + "' threads.\n");
+		}
+
+		uint8_t compressedMethod = GetEntropyCoder() == EntropyCoderType::ENTROPY_ADAPTIVE ? 4 : 3;
+
+		//a chunk is only stored compressed if that makes it smaller
+		auto IsChunkCompressed = [](const ArchiveChunk& chunk)
+			{
+				return !chunk.skipped
+					&& chunk.compData.size() < chunk.input.size();
+			};
+
+		//collect compressed chunks until the given one is back,
+		//only this thread marks them done so no lock is needed
+		auto WaitForChunk = [&](const ArchiveChunk& chunk)
+			{
+				while (!chunk.done)
+				{
+					uint32_t seen = chunkDone.Prepare();
+
+					ChunkTask task{};
+					bool any = false;
+					while (finished.TryPop(task))
+					{
+						task.chunk->done = true;
+						any = true;
+					}
+
+					if (any) spaceFreed.Notify();
+					else chunkDone.Wait(seen);
+				}
+			};
+
+		//free a written chunk and make room for the next ones
+		auto ReleaseChunk = [&](ArchiveChunk& chunk)
+			{
+				//assigning {} would keep the capacity, only a fresh vector gives the memory back
+				chunk.input = {};
+				chunk.mapped.reset();
+				chunk.raw = vector<uint8_t>();
+				chunk.compData = vector<uint8_t>();
+				inFlight -= chunk.size;
+				spaceFreed.Notify();
+			};
+
+		auto ReportEntry = [&](
+			const ArchiveEntry& entry,
+			uint64_t originalSize,
+			uint64_t compressedSize,
+			bool skipped)
+			{
+				if (originalSize == 0)
+				{
+					emptyCount++;
+
+					if (Core::IsVerboseLoggingEnabled())
+					{
+						Core::PrintMessage(
+							"[EMPTY] '" + path(entry.relPath).filename().string() + "'");
+					}
+				}
+				else if (skipped)
+				{
+					rawCount++;
+					skipCount++;
+
+					if (Core::IsVerboseLoggingEnabled())
+					{
+						Core::PrintMessage(
+							"[RAW] '" + path(entry.relPath).filename().string() + "' - looks incompressible, not compressed");
+					}
+				}
+				else if (compressedSize >= originalSize)
+				{
+					rawCount++;
+
+					if (Core::IsVerboseLoggingEnabled())
+					{
+						ostringstream ss{};
+
+						ss << "[RAW] '" << path(entry.relPath).filename().string()
+							<< "' - '" << compressedSize << " bytes' "
+							<< ">= '" << originalSize << " bytes'";
+
+						Core::PrintMessage(ss.str());
+					}
+				}
+				else
+				{
+					compCount++;
+
+					if (Core::IsVerboseLoggingEnabled())
+					{
+						ostringstream ss{};
+
+						ss << "[COMPRESS] '" << path(entry.relPath).filename().string()
+							<< "' - '" << compressedSize << " bytes' "
+							<< "< '" << originalSize << " bytes'";
+
+						if (entry.chunks.size() > 1) ss << " in '" << entry.chunks.size() << "' chunks";
+
+						Core::PrintMessage(ss.str());
+					}
+				}
+			};
+
+		//entries of more than one chunk are written as method 5 while their chunks come in.
+		//The sizes in the header and the chunk table are only known at the end,
+		//so placeholders are written first and filled in once the last chunk is written
+		auto WriteChunkedEntry = [&](ArchiveEntry& entry)
+			{
+				auto writeStart = high_resolution_clock::now();
+
+				uint32_t pathLen = (uint32_t)entry.relPath.size();
+				uint8_t method = 5;
+				uint64_t originalSize = 0;
+				uint64_t storedSize = 0;
+
+				streamoff sizesPos = static_cast<streamoff>(out.tellp())
+					+ static_cast<streamoff>(sizeof(uint32_t) + pathLen + sizeof(uint8_t));
+
+				out.write((char*)&pathLen, sizeof(uint32_t));
+				out.write(entry.relPath.data(), pathLen);
+				out.write((char*)&method, sizeof(uint8_t));
+				out.write((char*)&originalSize, sizeof(uint64_t));
+				out.write((char*)&storedSize, sizeof(uint64_t));
+
+				streamoff tablePos = out.tellp();
+				vector<uint8_t> table(CHUNK_TABLE_HEADER + entry.chunks.size() * CHUNK_TABLE_ENTRY);
+				out.write((char*)table.data(), table.size());
+
+				if (!out.good())
+				{
+					ForceClose(
+						"Failed to write metadata for file '" + entry.relPath + "' while building archive '" + target + "'!\n",
+						ForceCloseType::TYPE_COMPRESSION);
+
+					return false;
+				}
+				writeSeconds += duration<double>(high_resolution_clock::now() - writeStart).count();
+
+				//chunk table, offsets count from the end of the table
+				table.clear();
+
+				auto Append = [&table](const auto& value)
+					{
+						table.insert(
+							table.end(),
+							reinterpret_cast<const uint8_t*>(&value),
+							reinterpret_cast<const uint8_t*>(&value) + sizeof(value));
+					};
+
+				Append((uint32_t)entry.chunks.size());
+				Append((uint32_t)entry.chunkSize);
+
+				bool skipped = true;
+				uint64_t offset = 0;
+				for (auto& chunk : entry.chunks)
+				{
+					WaitForChunk(chunk);
+					writeStart = high_resolution_clock::now();
+
+					//the chunk table is laid out from the listed size, a file that shrank
+					//since it was listed would store fewer bytes than its table promises
+					if (chunk.input.size() != chunk.size)
+					{
+						ForceClose(
+							"File '" + entry.relPath + "' changed size while building archive '" + target + "'!\n",
+							ForceCloseType::TYPE_COMPRESSION);
+
+						return false;
+					}
+
+					bool isCompressed = IsChunkCompressed(chunk);
+					span<const uint8_t> finalData = isCompressed ? span<const uint8_t>(chunk.compData) : chunk.input;
+
+					Append(isCompressed ? compressedMethod : (uint8_t)0);
+					Append(offset);
+					Append((uint64_t)finalData.size());
+
+					out.write((char*)finalData.data(), finalData.size());
+					if (!out.good())
+					{
+						ForceClose(
+							"Failed to write final data for file '" + entry.relPath + "' while building archive '" + target + "'!\n",
+							ForceCloseType::TYPE_COMPRESSION);
+
+						return false;
+					}
+
+					offset += finalData.size();
+					originalSize += chunk.input.size();
+					skipped = skipped && chunk.skipped;
+
+					writeSeconds += duration<double>(high_resolution_clock::now() - writeStart).count();
+					ReleaseChunk(chunk);
+				}
+
+				//fill in the placeholders and carry on behind the last chunk
+				writeStart = high_resolution_clock::now();
+				storedSize = table.size() + offset;
+
+				streamoff endPos = out.tellp();
+				out.seekp(sizesPos);
+				out.write((char*)&originalSize, sizeof(uint64_t));
+				out.write((char*)&storedSize, sizeof(uint64_t));
+				out.seekp(tablePos);
+				out.write((char*)table.data(), table.size());
+				out.seekp(endPos);
+
+				if (!out.good())
+				{
+					ForceClose(
+						"Failed to write metadata for file '" + entry.relPath + "' while building archive '" + target + "'!\n",
+						ForceCloseType::TYPE_COMPRESSION);
+
+					return false;
+				}
+				writeSeconds += duration<double>(high_resolution_clock::now() - writeStart).count();
+
+				ReportEntry(entry, originalSize, storedSize, skipped);
+				return true;
+			};
+
+		for (auto& entry : entries)
+		{
+			if (entry.chunks.size() > 1)
+			{
+				if (!WriteChunkedEntry(entry))
+				{
+					StopWorkers();
+					return;
+				}
+				continue;
+			}
+
+			ArchiveChunk& chunk = entry.chunks.front();
+			WaitForChunk(chunk);
+
+			auto writeStart = high_resolution_clock::now();
+
+			uint32_t pathLen = (uint32_t)entry.relPath.size();
+
+			uint64_t originalSize = chunk.input.size();
+			uint64_t compressedSize = chunk.compData.size();
+
+			//safeguard: if compression is bigger or equal than original then store raw instead
+			bool useCompressed = !chunk.skipped && compressedSize < originalSize;
+			uint64_t finalSize = useCompressed ? compressedSize : originalSize;
+
+			//5 - chunks compressed independently with method 0, 3 or 4,
+			//4 - LZSS range coded, 3 - LZSS split streams with per-stream coder,
+			//2 - LZSS split streams Huffman only (decompression only), 1 - LZSS interleaved (decompression only), 0 = raw
+			uint8_t method = useCompressed ? compressedMethod : 0;
+
+			ReportEntry(entry, originalSize, compressedSize, chunk.skipped);
+
+			//write metadata
+			out.write((char*)&pathLen, sizeof(uint32_t));
+			out.write(entry.relPath.data(), pathLen);
+			out.write((char*)&method, sizeof(uint8_t));
+			out.write((char*)&originalSize, sizeof(uint64_t));
+			out.write((char*)&finalSize, sizeof(uint64_t));
+
+			if (!out.good())
+			{
+				ForceClose(
+					"Failed to write metadata for file '" + entry.relPath + "' while building archive '" + target + "'!\n",
+					ForceCloseType::TYPE_COMPRESSION);
+
+				StopWorkers();
+				return;
+			}
+
+			//write compressed data if it is more than 0 bytes
+			span<const uint8_t> finalData = useCompressed ? span<const uint8_t>(chunk.compData) : chunk.input;
+			if (!finalData.empty())
+			{
+				out.write((char*)finalData.data(), finalData.size());
+				if (!out.good())
+				{
+					ForceClose(
+						"Failed to write final data for file '" + entry.relPath + "' while building archive '" + target + "'!\n",
+						ForceCloseType::TYPE_COMPRESSION);
+
+					StopWorkers();
+					return;
+				}
+			}
+
+			writeSeconds += duration<double>(high_resolution_clock::now() - writeStart).count();
+			ReleaseChunk(chunk);
+		}
+
+		StopWorkers();
+
+		//finished writing
+		out.close();
+
+		//end timer
+		auto end = high_resolution_clock::now();
+		auto durationSec = duration<double>(end - start).count();
+
+		uint64_t folderSize{};
+		for (auto& p : recursive_directory_iterator(origin))
+		{
+			if (is_regular_file(p)) folderSize += file_size(p);
+		}
+
+		auto archiveSize = file_size(target);
+		auto mbps = static_cast<double>(folderSize) / (1024.0 * 1024.0) / durationSec;
+
+		auto ratio = (static_cast<double>(archiveSize) / folderSize) * 100.0;
+		auto factor = static_cast<double>(folderSize) / archiveSize;
+		auto saved = 100.0 - ratio;
+
+		ostringstream finishComp{};
+
+		if (Core::IsVerboseLoggingEnabled())
+		{
+			finishComp 
+				<< "Finished compressing folder '" << origin << "' to archive '" << target << "'!\n"
+				<< "  - origin folder size: " << folderSize << " bytes\n"
+				<< "  - target archive size: " << archiveSize << " bytes\n"
+				<< "  - compression ratio: " << fixed << setprecision(2) << ratio << "%\n"
+				<< "  - space saved: " << fixed << setprecision(2) << saved << "%\n"
+				<< "  - compression factor: " << fixed << setprecision(2) << factor << "x\n"
+				<< "  - throughput: " << fixed << setprecision(2) << mbps << " MB/s\n"
+				<< "  - total files: " << fileCount << "\n"
+				<< "  - compressed: " << compCount << "\n"
+				<< "  - stored raw: " << rawCount << "\n"
+				<< "  - stored raw without a compression attempt: " << skipCount << "\n"
+				<< "  - empty: " << emptyCount << "\n"
+				<< "  - duration: " << fixed << setprecision(2) << durationSec << " seconds\n"
+				<< "  - reader: busy " << fixed << setprecision(2) << readSeconds << "s\n"
+				<< "  - writer: busy " << fixed << setprecision(2) << writeSeconds << "s\n"
+				<< "  - memory mapped: " << mappedChunks << " chunks, " << mappedBytes << " bytes, "
+				<< MappedFile::GetStats().syscalls << " system calls\n"
+				<< DescribeFileIO()
+				<< "  - worker utilization:\n";
+
+			for (size_t i = 0; i < stats.size(); i++)
+			{
+				double idle = poolSeconds > stats[i].busy ? poolSeconds - stats[i].busy : 0.0;
+				double busyShare = poolSeconds > 0.0 ? stats[i].busy / poolSeconds * 100.0 : 0.0;
+
+				finishComp
+					<< "    - worker " << i << ": "
+					<< "busy " << fixed << setprecision(2) << stats[i].busy << "s, "
+					<< "idle " << fixed << setprecision(2) << idle << "s "
+					<< "(" << fixed << setprecision(1) << busyShare << "% busy), "
+					<< "tasks " << stats[i].tasks << ", "
+					<< "stolen " << stats[i].stolen << "\n";
+			}
+		}
+		else
+		{
+			finishComp
+				<< "Finished compressing folder '" << path(origin).filename().string()
+				<< "' to archive '" << path(target).filename().string() << "'!\n"
+				<< "  - origin folder size: " << folderSize << " bytes\n"
+				<< "  - target archive size: " << archiveSize << " bytes\n"
+				<< "  - space saved: " << fixed << setprecision(2) << saved << "%\n"
+				<< "  - throughput: " << fixed << setprecision(2) << mbps << " MB/s\n"
+				<< "  - duration: " << fixed << setprecision(2) << durationSec << " seconds\n";
+		}
+
+		Core::PrintMessage(
+			finishComp.str(),
+			MessageType::MESSAGETYPE_SUCCESS);
+
+		Command::SetCommandAllowState(true);
+	}
+
+	void Compress::DecompressToFolder(
+		const string& origin,
+		const string& target)
+	{
+		Command::SetCommandAllowState(false);
+
+		Core::PrintMessage(
+			"Starting to decompress archive '" + origin + "' to folder '" + target + "'!\n");
+
+		//start clock timer
+		auto start = high_resolution_clock::now();
+		FileIO::ResetStats();
+
+		ifstream in(origin, ios::binary);
+		if (!in.is_open())
+		{
+			ForceClose(
+				"Failed to open origin archive '" + origin + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return;
+		}
+
+		uint32_t compCount{};
+		uint32_t rawCount{};
+		uint32_t emptyCount{};
+
+		//read magic number
+		char magicVer[6]{};
+		in.read(magicVer, sizeof(magicVer));
+
+		//check magic
+		if (memcmp(magicVer, "KDAT", 4) != 0)
+		{
+			ForceClose(
+				"Invalid magic value in archive '" + origin + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return;
+		}
+
+		//check version range
+		int version = stoi(string(magicVer + 4, 2));
+		if (version < 1
+			|| version > 99)
+		{
+			ForceClose(
+				"Out of range version '" + to_string(version) + "' in archive '" + origin + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return;
+		}
+
+		//check version validity
+
+		char version_major = KALADATA_VERSION[9];
+		char version_minor = KALADATA_VERSION[11];
+
+		string thisVersion{ magicVer[4], magicVer[5] };
+		string requiredVersion{ version_major, version_minor };
+
+		if (thisVersion != requiredVersion
+			&& version != LEGACY_ARCHIVE_VERSION)
+		{
+			ForceClose(
+				"Unsupported version '" + thisVersion + "' in archive '" + origin + "'! Version must be '" + requiredVersion + "' or '01'\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return;
+		}
+
+		if (Core::IsVerboseLoggingEnabled())
+		{
+			ostringstream ss{};
+
+			ss << "Window size is '" << WINDOW_SIZE << "'.\n"
+				<< "Lookahead is '" << LOOKAHEAD << "'.\n"
+				<< "Max chain depth is '" << MAX_CHAIN << "'.\n"
+				<< "Min match is '" << MIN_MATCH << "'.\n"
+				<< "Match kernel is '" << Simd::GetLevelName() << "'.\n\n"
+				<< "Archive '" + target + "' version is '" + string(magicVer, 6) + "'.\n";
+
+			Core::PrintMessage(ss.str());
+		}
+
+		uint32_t fileCount{};
+		in.read((char*)&fileCount, sizeof(uint32_t));
+		if (fileCount > 100000)
+		{
+			ForceClose(
+				"Archive '" + origin + "' reports an absurd file count (corrupted?)!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return;
+		}
+
+		if (fileCount == 0)
+		{
+			ForceClose(
+				"Archive '" + origin + "' contains no valid files to decompress!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return;
+		}
+
+		if (!in.good())
+		{
+			ForceClose(
+				"Unexpected EOF while reading header data in archive '" + origin + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return;
+		}
+
+		//read every entry header first and remember where its data is,
+		//the data itself is read by the workers
+		uint64_t archiveBytes = file_size(origin);
+		vector<ExtractTask> tasks{};
+
+		//the target and the folder of the last entry are only looked up once,
+		//entries of one folder usually follow each other
+		auto absTarget = weakly_canonical(target);
+		path lastFolder{};
+
+		for (uint32_t i = 0; i < fileCount; i++)
+		{
+			uint32_t pathLen{};
+			in.read((char*)&pathLen, sizeof(uint32_t));
+
+			string relPath(pathLen, '\0');
+			in.read(relPath.data(), pathLen);
+
+			uint8_t method{};
+			in.read((char*)&method, sizeof(uint8_t));
+
+			uint64_t originalSize{};
+			in.read((char*)&originalSize, sizeof(uint64_t));
+
+			uint64_t storedSize{};
+			in.read((char*)&storedSize, sizeof(uint64_t));
+
+			if (!in.good())
+			{
+				ForceClose(
+					"Unexpected EOF while reading metadata in archive '" + origin + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION);
+
+				return;
+			}
+
+			if (method == 0)
+			{
+				if (storedSize != originalSize)
+				{
+					ostringstream ss{};
+
+					ss << "Stored size '" << storedSize << "' for raw file '" << relPath << "' "
+						<< "is not the same as original size '" << originalSize << "' "
+						<< "in archive '" << target << "' (corruption suspected)!\n";
+
+					ForceClose(
+						ss.str(),
+						ForceCloseType::TYPE_DECOMPRESSION);
+
+					return;
+				}
+			}
+			else if (method == 1
+				|| method == 2
+				|| method == 3
+				|| method == 4
+				|| method == 5)
+			{
+				//chunked entries are written while they are compressed, so an entry whose chunks were all
+				//stored raw stays chunked and is larger than the file by its chunk table,
+				//AddChunkTasks checks every chunk on its own
+				if (method != 5
+					&& storedSize >= originalSize)
+				{
+					ostringstream ss{};
+
+					ss << "Stored size '" << storedSize << "' for compressed file '" << relPath << "' "
+						<< "is the same or bigger than the original size '" << originalSize << "' "
+						<< "in archive '" << target << "' (corruption suspected)!\n";
+
+					ForceClose(
+						ss.str(),
+						ForceCloseType::TYPE_DECOMPRESSION);
+
+					return;
+				}
+			}
+			else
+			{
+				ForceClose(
+					"Unknown method storage flag '" + to_string(method) + "' in archive '" + origin + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION);
+
+				return;
+			}
+
+			if (originalSize == 0) emptyCount++;
+			else if (storedSize < originalSize) compCount++;
+			else rawCount++;
+
+			path outPath = path(target) / relPath;
+			if (outPath.parent_path() != lastFolder)
+			{
+				lastFolder = outPath.parent_path();
+				create_directories(lastFolder);
+			}
+
+			//path traversal check
+			auto absOut = weakly_canonical(outPath);
+
+			if (absOut.string().find(absTarget.string()) != 0)
+			{
+				ForceClose(
+					"Archive '" + origin + "' contains invalid path '" + relPath + "' (path traveral attempt)!",
+					ForceCloseType::TYPE_DECOMPRESSION);
+
+				return;
+			}
+
+			uint64_t storedOffset = static_cast<uint64_t>(in.tellg());
+			if (storedSize > archiveBytes - storedOffset)
+			{
+				ForceClose(
+					"Unexpected end of archive while reading data for '" + relPath + "' in archive '" + origin + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION);
+
+				return;
+			}
+
+			if (method == 0)
+			{
+				if (storedSize == 0
+					&& Core::IsVerboseLoggingEnabled())
+				{
+					Core::PrintMessage(
+						"[EMPTY] '" + path(relPath).filename().string() + "'");
+				}
+				else if (Core::IsVerboseLoggingEnabled())
+				{
+					ostringstream ss{};
+
+					ss << "[RAW] '" << path(relPath).filename().string()
+						<< "' - '" << storedSize << " bytes' "
+						<< ">= '" << originalSize << " bytes'";
+
+					Core::PrintMessage(ss.str());
+				}
+			}
+			else if (Core::IsVerboseLoggingEnabled())
+			{
+				ostringstream ss{};
+
+				ss << "[DECOMPRESS] '" << path(relPath).filename().string()
+					<< "' - '" << storedSize << " bytes' "
+					<< "< '" << originalSize << " bytes'";
+
+				Core::PrintMessage(ss.str());
+			}
+
+			ExtractTask task{ outPath, relPath, method, storedOffset, storedSize, 0, originalSize, true };
+
+			//chunked files are created at their full size, workers write their chunks into it at their own offsets,
+			//every other file is created by the worker that writes it. The chunk table is checked
+			//against the sizes first, so a damaged size never gets to create a huge file
+			if (method == 5)
+			{
+				if (!AddChunkTasks(in, task, tasks, origin)) return;
+
+				{
+					ofstream outFile(outPath, ios::binary);
+					if (!outFile.is_open())
+					{
+						ForceClose(
+							"Failed to extract file '" + relPath + "' from archive '" + origin + "' into target folder '" + target + "'!\n",
+							ForceCloseType::TYPE_DECOMPRESSION);
+						return;
+					}
+				}
+
+				error_code resizeError{};
+				resize_file(outPath, originalSize, resizeError);
+				if (resizeError)
+				{
+					ForceClose(
+						"Failed to create file '" + relPath + "' at its size of '" + to_string(originalSize) + "' bytes in target folder '" + target + "': " + resizeError.message() + "!\n",
+						ForceCloseType::TYPE_DECOMPRESSION);
+					return;
+				}
+			}
+			else tasks.push_back(task);
+
+			in.seekg(static_cast<streamoff>(storedOffset + storedSize));
+		}
+
+		//every entry and chunk decodes on its own, so they are spread over the workers,
+		//largest first so the longest task does not start last
+		stable_sort(
+			tasks.begin(),
+			tasks.end(),
+			[](const ExtractTask& a, const ExtractTask& b) { return a.originalSize > b.originalSize; });
+
+		//the small tasks at the end are claimed IO_BATCH_FILES at a time,
+		//so their reads and writes are batched
+		size_t smallStart = tasks.size();
+		while (smallStart > 0
+			&& tasks[smallStart - 1].originalSize <= IO_BATCH_BYTES / IO_BATCH_FILES)
+		{
+			smallStart--;
+		}
+
+		atomic<size_t> nextTask = 0;
+		atomic<bool> failed = false;
+
+		auto Worker = [&]()
+			{
+				while (!failed)
+				{
+					size_t first = nextTask.load();
+					size_t count{};
+					do
+					{
+						if (first >= tasks.size()) return;
+
+						count = first >= smallStart ? min(IO_BATCH_FILES, tasks.size() - first) : 1;
+					} while (!nextTask.compare_exchange_weak(first, first + count));
+
+					if (!ExtractParts(tasks, first, count, version, origin)) failed = true;
+				}
+			};
+
+		size_t threadCount = GetThreadCount();
+		if (threadCount > tasks.size()) threadCount = tasks.size();
+
+		if (Core::IsVerboseLoggingEnabled())
+		{
+			Core::PrintMessage(
+				"Decompressing with '" + to_string(threadCount) + "' threads.\n");
+		}
+
+		vector<thread> workers{};
+		for (size_t i = 0; i < threadCount; i++) workers.emplace_back(Worker);
+		for (auto& worker : workers) worker.join();
+
+		if (failed) return;
+
+		//end timer
+		auto end = high_resolution_clock::now();
+		auto durationSec = duration<double>(end - start).count();
+
+		uint64_t folderSize{};
+		for (auto& p : recursive_directory_iterator(target))
+		{
+			if (is_regular_file(p)) folderSize += file_size(p);
+		}
+
+		auto archiveSize = file_size(origin);
+		auto mbps = static_cast<double>(archiveSize) / (1024.0 * 1024.0) / durationSec;
+
+		auto ratio = (static_cast<double>(folderSize) / archiveSize) * 100.0;
+		auto factor = static_cast<double>(folderSize) / archiveSize;
+		auto saved = 100.0 - ratio;
+
+		ostringstream finishDecomp{};
+
+		if (Core::IsVerboseLoggingEnabled())
+		{
+			finishDecomp 
+				<< "Finished decompressing archive '" << origin << "' to folder '" << target << "'!\n"
+				<< "  - origin archive size: " << archiveSize << " bytes\n"
+				<< "  - target folder size: " << folderSize << " bytes\n"
+				<< "  - expansion ratio: " << fixed << setprecision(2) << ratio << "%\n"
+				<< "  - expansion factor: " << fixed << setprecision(2) << factor << "x\n"
+				<< "  - throughput: " << fixed << setprecision(2) << mbps << " MB/s\n"
+				<< "  - total files: " << fileCount << "\n"
+				<< "  - decompressed: " << compCount << "\n"
+				<< "  - unpacked raw: " << rawCount << "\n"
+				<< "  - empty: " << emptyCount << "\n"
+				<< "  - duration: " << fixed << setprecision(2) << durationSec << " seconds\n"
+				<< DescribeFileIO();
+		}
+		else
+		{
+			finishDecomp 
+				<< "Finished decompressing archive '" << path(origin).filename().string()
+				<< "' to folder '" << path(target).filename().string() << "'!\n"
+				<< "  - origin archive size: " << archiveSize << " bytes\n"
+				<< "  - target folder size: " << folderSize << " bytes\n"
+				<< "  - throughput: " << fixed << setprecision(2) << mbps << " MB/s\n"
+				<< "  - duration: " << fixed << setprecision(2) << durationSec << " seconds\n";
+		}
+
+		Core::PrintMessage(
+			finishDecomp.str(),
+			MessageType::MESSAGETYPE_SUCCESS);
+
+		Command::SetCommandAllowState(true);
+	}
+}
+
+void ForceClose(
+	const string& message,
+	ForceCloseType type)
+{
+	string title{};
+
+	switch (type)
+	{
+	case ForceCloseType::TYPE_COMPRESSION:
+		title = "Compression error";
+		break;
+	case ForceCloseType::TYPE_DECOMPRESSION:
+		title = "Decompression error";
+		break;
+	case ForceCloseType::TYPE_COMPRESSION_BUFFER:
+		title = "Compression buffer error";
+		break;
+	case ForceCloseType::TYPE_DECOMPRESSION_BUFFER:
+		title = "Decompression buffer error";
+		break;
+	case ForceCloseType::TYPE_HUFFMAN_ENCODE:
+		title = "Huffman encode error";
+		break;
+	case ForceCloseType::TYPE_HUFFMAN_DECODE:
+		title = "Huffman decode error";
+		break;
+	}
+
+	Core::ForceClose(title, message);
+}
+
+void CompressChunk(
+	const ArchiveEntry& entry,
+	ArchiveChunk& chunk)
+{
+	//known compressed formats and random-looking data go straight to raw storage
+	chunk.skipped = IsIncompressible(chunk.input);
+
+	//compress directly into memory
+	if (!chunk.skipped) chunk.compData = CompressBuffer(chunk.input, entry.relPath);
+}
+
+bool IsIncompressible(span<const uint8_t> input)
+{
+	if (input.size() < SAMPLE_MIN_FILE_SIZE) return false;
+
+	//small inputs are checked whole
+	if (input.size() <= SAMPLE_SIZE * SAMPLE_COUNT)
+	{
+		return IsRandomSlice(input.data(), input.size());
+	}
+
+	//a known format only needs one slice to confirm it, the signature alone is not enough
+	//since some writers store data barely compressed (fast png encoders, small deflate windows)
+	if (HasCompressedSignature(input))
+	{
+		return IsRandomSlice(input.data() + (input.size() - SAMPLE_SIZE) / 2, SAMPLE_SIZE);
+	}
+
+	//larger inputs are checked by evenly spaced slices that include the start and the end
+
+	size_t stride = (input.size() - SAMPLE_SIZE) / (SAMPLE_COUNT - 1);
+	for (size_t i = 0; i < SAMPLE_COUNT; i++)
+	{
+		if (!IsRandomSlice(input.data() + i * stride, SAMPLE_SIZE)) return false;
+	}
+
+	return true;
+}
+
+bool HasCompressedSignature(span<const uint8_t> input)
+{
+	struct Signature
+	{
+		size_t offset;
+		const char* bytes;
+		size_t size;
+	};
+
+	//formats that are deflate, lzma, zstd, jpeg or codec coded throughout,
+	//formats that may hold stored data (tar, wav, bmp, pdf) are left to the estimate
+	static const Signature signatures[] =
+	{
+		{ 0, "PK\x03\x04", 4 },             //zip, jar, docx, apk
+		{ 0, "\x1F\x8B", 2 },                //gzip
+		{ 0, "7z\xBC\xAF\x27\x1C", 6 },        //7z
+		{ 0, "\xFD" "7zXZ\x00", 6 },          //xz
+		{ 0, "BZh", 3 },                      //bzip2
+		{ 0, "\x28\xB5\x2F\xFD", 4 },          //zstd
+		{ 0, "\x04\x22\x4D\x18", 4 },          //lz4
+		{ 0, "Rar!\x1A\x07", 6 },              //rar
+		{ 0, "KDAT", 4 },                     //KalaData archive
+		{ 0, "\x89PNG\r\n\x1A\n", 8 },          //png
+		{ 0, "\xFF\xD8\xFF", 3 },              //jpeg
+		{ 0, "GIF8", 4 },                     //gif
+		{ 8, "WEBP", 4 },                     //webp
+		{ 4, "ftyp", 4 },                     //mp4, mov, heic
+		{ 0, "\x1A\x45\xDF\xA3", 4 },          //mkv, webm
+		{ 0, "OggS", 4 },                     //ogg
+		{ 0, "fLaC", 4 },                     //flac
+		{ 0, "ID3", 3 }                       //mp3
+	};
+
+	for (const auto& signature : signatures)
+	{
+		if (input.size() >= signature.offset + signature.size
+			&& memcmp(input.data() + signature.offset, signature.bytes, signature.size) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool IsRandomSlice(
+	const uint8_t* data,
+	size_t size)
+{
+	size_t freq[256]{};
+	for (size_t i = 0; i < size; i++) freq[data[i]]++;
+
+	double entropy = 0.0;
+	for (size_t count : freq)
+	{
+		if (count == 0) continue;
+
+		double p = static_cast<double>(count) / size;
+		entropy -= p * log2(p);
+	}
+	if (entropy < SAMPLE_MIN_ENTROPY) return false;
+
+	//evenly spread bytes can still repeat as whole strings, so also count positions
+	//whose next 4 bytes were already seen at the last position with the same hash
+	constexpr size_t HASH_BITS = 12;
+	uint32_t lastSeen[size_t(1) << HASH_BITS]{};
+
+	size_t matches = 0;
+	for (size_t i = 0; i + 4 <= size; i++)
+	{
+		uint32_t value{};
+		memcpy(&value, data + i, sizeof(uint32_t));
+
+		uint32_t hash = (value * 2654435761u) >> (32 - HASH_BITS);
+		uint32_t candidate = lastSeen[hash];
+		lastSeen[hash] = (uint32_t)i + 1;
+
+		if (candidate != 0
+			&& memcmp(data + candidate - 1, &value, sizeof(uint32_t)) == 0)
+		{
+			matches++;
+		}
+	}
+
+	return static_cast<double>(matches) / size < SAMPLE_MAX_MATCH_RATE;
+}
+
+vector<uint8_t> CompressBuffer(
+	span<const uint8_t> input,
+	const string& origin)
+{
+	vector<uint8_t> output{};
+
+	if (input.empty()) return output;
+
+	//offsets are coded from 32-bit values and lengths are stored in one byte
+	if (Compress::GetWindowSize() >= UINT32_MAX)
+	{
+		ForceClose(
+			"Offset too large for file '" + origin + "' during compressing (data window exceeded)!\n",
+			ForceCloseType::TYPE_COMPRESSION_BUFFER);
+
+		return {};
+	}
+	if (Compress::GetLookAhead() > UINT8_MAX)
+	{
+		ForceClose(
+			"Match length too large for file '" + origin + "' during compressing (overflow)!\n",
+			ForceCloseType::TYPE_COMPRESSION_BUFFER);
+
+		return {};
+	}
+
+	MatchFinder finder(input);
+	TokenStreams streams{};
+	TokenWriter writer(streams);
+
+	switch (Compress::GetParser())
+	{
+	case ParserType::PARSER_GREEDY:
+		ParseGreedy(input, finder, writer);
+		break;
+	case ParserType::PARSER_LAZY:
+		ParseLazy(input, finder, writer);
+		break;
+	case ParserType::PARSER_OPTIMAL:
+		ParseOptimal(input, finder, writer);
+		break;
+	}
+	writer.Finish();
+
+	if (Compress::GetEntropyCoder() == EntropyCoderType::ENTROPY_ADAPTIVE)
+	{
+		output = EncodeAdaptive(input, streams);
+	}
+	else
+	{
+		//each stream is stored as its size followed by its bytes,
+		//the extra bits are already packed and are stored as is
+		const vector<uint8_t>* codedStreams[] =
+		{
+			&streams.control,
+			&streams.literals,
+			&streams.lengths,
+			&streams.offsetCodes
+		};
+		for (const vector<uint8_t>* stream : codedStreams)
+		{
+			if (stream->empty())
+			{
+				AppendStream(output, *stream);
+				continue;
+			}
+
+			//tANS wins on skewed streams where Huffman rounds codes up to whole bits
+			vector<uint8_t> huffman = HuffmanEncode(*stream, origin);
+			vector<uint8_t> tans = Tans::Encode(*stream);
+
+			bool useTans = tans.size() < huffman.size();
+			vector<uint8_t>& best = useTans ? tans : huffman;
+
+			best.insert(best.begin(), useTans ? CODER_TANS : CODER_HUFFMAN);
+			AppendStream(output, best);
+		}
+		AppendStream(output, streams.extraBits);
+	}
+
+	if (output.empty())
+	{
+		ForceClose(
+			"Compression produced empty output for file '" + origin + "' (unexpected)!\n",
+			ForceCloseType::TYPE_COMPRESSION_BUFFER);
+	}
+
+	return output;
+}
+
+Match FindBestMatch(
+	MatchFinder& finder,
+	const RepHistory& reps,
+	size_t pos,
+	size_t niceLength,
+	vector<Match>& matches)
+{
+	Match rep = finder.FindRep(pos, reps);
+
+	if (rep.length >= niceLength
+		|| (rep.length != 0
+		&& rep.length == finder.MaxLength(pos)))
+	{
+		finder.Skip(pos);
+		return rep;
+	}
+
+	finder.Find(pos, matches);
+	if (matches.empty()) return rep;
+
+	//a recent offset costs far fewer bits than a new one,
+	//so it wins unless the search found a clearly longer match
+	const Match& longest = matches.back();
+	if (rep.length != 0
+		&& rep.length + 1 >= longest.length)
+	{
+		return rep;
+	}
+
+	return longest;
+}
+
+void ParseGreedy(
+	span<const uint8_t> input,
+	MatchFinder& finder,
+	TokenWriter& writer)
+{
+	//matches this long at a recent offset are taken without searching the window
+	constexpr size_t NICE_LENGTH = 32;
+
+	vector<Match> matches{};
+
+	size_t pos = 0;
+
+	while (pos < input.size())
+	{
+		Match best = FindBestMatch(finder, writer.reps, pos, NICE_LENGTH, matches);
+
+		if (best.length != 0)
+		{
+			writer.Match(best.offset, best.length);
+
+			for (size_t i = 1; i < best.length; i++)
+			{
+				finder.Skip(pos + i);
+			}
+			pos += best.length;
+		}
+		else
+		{
+			writer.Literal(input[pos]);
+			pos++;
+		}
+	}
+}
+
+void ParseLazy(
+	span<const uint8_t> input,
+	MatchFinder& finder,
+	TokenWriter& writer)
+{
+	//matches this long are taken without looking ahead
+	constexpr size_t NICE_LENGTH = 32;
+
+	vector<Match> matches{};
+
+	//best always holds the match at pos,
+	//next is the first position the finder has not seen yet
+	size_t pos = 0;
+	Match best = FindBestMatch(finder, writer.reps, pos, NICE_LENGTH, matches);
+	size_t next = pos + 1;
+
+	while (pos < input.size())
+	{
+		if (best.length == 0)
+		{
+			writer.Literal(input[pos]);
+			pos++;
+
+			if (pos < input.size())
+			{
+				best = FindBestMatch(finder, writer.reps, pos, NICE_LENGTH, matches);
+				next = pos + 1;
+			}
+			continue;
+		}
+
+		if (best.length < NICE_LENGTH
+			&& pos + 1 < input.size())
+		{
+			Match peek = FindBestMatch(finder, writer.reps, pos + 1, NICE_LENGTH, matches);
+			next = pos + 2;
+
+			//defer the match by one literal and evaluate again from the next position,
+			//so a run of ever longer matches keeps deferring
+			if (peek.length > best.length)
+			{
+				writer.Literal(input[pos]);
+				pos++;
+
+				best = peek;
+				continue;
+			}
+		}
+
+		writer.Match(best.offset, best.length);
+
+		for (size_t i = next; i < pos + best.length; i++)
+		{
+			finder.Skip(i);
+		}
+		pos += best.length;
+
+		if (pos < input.size())
+		{
+			best = FindBestMatch(finder, writer.reps, pos, NICE_LENGTH, matches);
+			next = pos + 1;
+		}
+	}
+}
+
+void ParseOptimal(
+	span<const uint8_t> input,
+	MatchFinder& finder,
+	TokenWriter& writer)
+{
+	//positions per dynamic programming pass
+	constexpr size_t BLOCK_SIZE = 4096;
+
+	//matches this long are taken right away, searching past them rarely pays off
+	constexpr size_t NICE_LENGTH = 128;
+
+	//cheapest known way to reach each position in the block and the recent
+	//offsets along that way, length 0 means the position was reached by a literal
+	struct Node
+	{
+		uint64_t price;
+		size_t length;
+		size_t offset;
+		RepHistory reps;
+	};
+
+	vector<Node> nodes(BLOCK_SIZE + 1);
+	vector<Node> path{};
+	vector<Match> matches{};
+
+	writer.UpdatePrices();
+	size_t pricedAt = 0;
+
+	size_t pos = 0;
+
+	while (pos < input.size())
+	{
+		size_t end = (input.size() - pos < BLOCK_SIZE)
+			? input.size()
+			: pos + BLOCK_SIZE;
+
+		nodes[0] = { 0, 0, 0, writer.reps };
+		for (size_t k = 1; k <= end - pos; k++)
+		{
+			nodes[k] = { UINT64_MAX, 0, 0, {} };
+		}
+
+		Match nice{ 0, 0 };
+
+		for (size_t i = pos; i < end; i++)
+		{
+			size_t k = i - pos;
+			uint64_t base = nodes[k].price;
+			RepHistory reps = nodes[k].reps;
+
+			//recent offsets are tried first, a long enough one makes the window search unnecessary
+			Match rep = finder.FindRep(i, reps);
+			if (rep.length >= NICE_LENGTH)
 			{
-				ostringstream ss{};
+				finder.Skip(i);
+
+				nice = rep;
+				end = i;
+				break;
+			}
+
+			finder.Find(i, matches);
+
+			if (!matches.empty()
+				&& matches.back().length >= NICE_LENGTH)
+			{
+				//close the block here and take the long match as is
+				nice = matches.back();
+				end = i;
+				break;
+			}
+
+			uint64_t literalPrice = base + writer.LiteralPrice(input[i]);
+			if (literalPrice < nodes[k + 1].price)
+			{
+				nodes[k + 1] = { literalPrice, 0, 0, reps };
+			}
+
+			size_t maxLength = finder.MaxLength(i);
+			if (maxLength > end - i) maxLength = end - i;
+
+			//every length of a recent offset match is reachable
+			for (uint32_t offset : reps.offsets)
+			{
+				if (offset > i
+					|| maxLength < MIN_MATCH)
+				{
+					continue;
+				}
+
+				size_t repLength = Simd::MatchLength(
+					&input[i],
+					&input[i - offset],
+					maxLength);
+
+				RepHistory next = reps;
+				next.Use(offset);
+
+				for (size_t length = MIN_MATCH; length <= repLength; length++)
+				{
+					uint64_t matchPrice = base + writer.MatchPrice(offset, length, reps);
+					if (matchPrice < nodes[k + length].price)
+					{
+						nodes[k + length] = { matchPrice, length, offset, next };
+					}
+				}
+			}
+
+			//every length up to each candidate's longest is reachable with its offset
+			size_t length = MIN_MATCH;
+			for (const auto& match : matches)
+			{
+				RepHistory next = reps;
+				next.Use(match.offset);
+
+				for (; length <= match.length; length++)
+				{
+					if (k + length > end - pos) break;
+
+					uint64_t matchPrice = base + writer.MatchPrice(match.offset, length, reps);
+					if (matchPrice < nodes[k + length].price)
+					{
+						nodes[k + length] = { matchPrice, length, match.offset, next };
+					}
+				}
+			}
+		}
+
+		//walk back from the end of the block and emit the cheapest path in order
+		path.clear();
+		for (size_t k = end - pos; k > 0;)
+		{
+			path.push_back(nodes[k]);
+			k -= (nodes[k].length == 0) ? 1 : nodes[k].length;
+		}
+		for (auto it = path.rbegin(); it != path.rend(); it++)
+		{
+			if (it->length == 0) writer.Literal(input[pos]);
+			else writer.Match(it->offset, it->length);
+
+			pos += (it->length == 0) ? 1 : it->length;
+		}
+
+		if (nice.length != 0)
+		{
+			writer.Match(nice.offset, nice.length);
+
+			for (size_t i = 1; i < nice.length; i++)
+			{
+				finder.Skip(pos + i);
+			}
+			pos += nice.length;
+		}
+
+		//blocks closed early by a long match are short, so prices are
+		//refreshed by the amount of input covered rather than per block
+		if (pos - pricedAt >= BLOCK_SIZE)
+		{
+			writer.UpdatePrices();
+			pricedAt = pos;
+		}
+	}
+}
+
+void AppendStream(
+	vector<uint8_t>& output,
+	const vector<uint8_t>& stream)
+{
+	uint32_t size = (uint32_t)stream.size();
+	output.insert(
+		output.end(),
+		reinterpret_cast<uint8_t*>(&size),
+		reinterpret_cast<uint8_t*>(&size) + sizeof(uint32_t));
+
+	output.insert(
+		output.end(),
+		stream.begin(),
+		stream.end());
+}
+
+void DecompressStreams(
+	const vector<uint8_t>& payload,
+	OutputWindow& out,
+	size_t originalSize,
+	bool tagged,
+	const string& target)
+{
+	//skip decompressing empty file
+	if (originalSize == 0)
+	{
+		out.Finish();
+		return;
+	}
+
+	//control, literals, lengths and offset codes are entropy coded, extra bits are stored as is
+	constexpr size_t STREAM_COUNT = 5;
+	const uint8_t* streamData[STREAM_COUNT]{};
+	size_t streamSize[STREAM_COUNT]{};
+
+	size_t pos = 0;
+	for (size_t i = 0; i < STREAM_COUNT; i++)
+	{
+		uint32_t size{};
+		if (pos + sizeof(uint32_t) > payload.size())
+		{
+			ForceClose(
+				"Unexpected end of payload while reading stream sizes in '" + target + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+			return;
+		}
+		memcpy(&size, &payload[pos], sizeof(uint32_t));
+		pos += sizeof(uint32_t);
+
+		if (size > payload.size() - pos)
+		{
+			ForceClose(
+				"Stream size is larger than the payload in '" + target + "' (corruption suspected)!\n",
+				ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+			return;
+		}
+
+		streamData[i] = payload.data() + pos;
+		streamSize[i] = size;
+		pos += size;
+	}
+
+	if (pos != payload.size())
+	{
+		ForceClose(
+			"Trailing data after the last stream in '" + target + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+		return;
+	}
+
+	vector<uint8_t> decoded[STREAM_COUNT - 1]{};
+	for (size_t i = 0; i < STREAM_COUNT - 1; i++)
+	{
+		if (streamSize[i] == 0) continue;
+
+		if (!tagged)
+		{
+			decoded[i] = HuffmanDecode(streamData[i], streamSize[i], target);
+			continue;
+		}
+
+		//no stream decodes to more bytes than the file itself
+		uint8_t coder = streamData[i][0];
+		if (coder == CODER_HUFFMAN)
+		{
+			decoded[i] = HuffmanDecode(streamData[i] + 1, streamSize[i] - 1, target);
+		}
+		else if (coder == CODER_TANS)
+		{
+			if (!Tans::Decode(
+				streamData[i] + 1,
+				streamSize[i] - 1,
+				originalSize,
+				decoded[i]))
+			{
+				ForceClose(
+					"Invalid tANS stream in '" + target + "' (corruption suspected)!\n",
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+				return;
+			}
+		}
+		else
+		{
+			ForceClose(
+				"Unknown entropy coder '" + to_string(coder) + "' in '" + target + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+			return;
+		}
+	}
+
+	const vector<uint8_t>& control = decoded[0];
+	const vector<uint8_t>& literals = decoded[1];
+	const vector<uint8_t>& lengths = decoded[2];
+	const vector<uint8_t>& offsetCodes = decoded[3];
+
+	const uint8_t* extraBits = streamData[4];
+	size_t extraBitCount = streamSize[4] * 8;
+
+	size_t written = 0;
+
+	size_t controlPos = 0;
+	size_t literalPos = 0;
+	size_t matchPos = 0;
+	size_t extraPos = 0;
+
+	uint8_t flags = 0;
+	uint8_t controlBit = 8;
+
+	RepHistory reps{};
+
+	//the last control byte may have unused bits, so the output size decides when to stop
+	while (written < originalSize)
+	{
+		if (controlBit == 8)
+		{
+			if (controlPos >= control.size())
+			{
+				ForceClose(
+					"Unexpected end of control stream in '" + target + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+				return;
+			}
+
+			flags = control[controlPos++];
+			controlBit = 0;
+		}
+
+		bool isMatch = (flags >> controlBit++) & 1;
+
+		if (!isMatch) //literal
+		{
+			if (literalPos >= literals.size())
+			{
+				ForceClose(
+					"Unexpected end of literal stream in '" + target + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+				return;
+			}
+
+			uint8_t* dst = out.Reserve(written, 1);
+			if (dst == nullptr) return;
+
+			*dst = literals[literalPos++];
+			written++;
+			continue;
+		}
+
+		//reference
+		if (matchPos >= lengths.size()
+			|| matchPos >= offsetCodes.size())
+		{
+			ForceClose(
+				"Unexpected end of match streams in '" + target + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+			return;
+		}
+
+		size_t length = lengths[matchPos] + MIN_MATCH;
+		uint8_t code = offsetCodes[matchPos];
+		matchPos++;
+
+		size_t offset{};
+		if (code < REP_CODES) offset = reps.offsets[code];
+		else
+		{
+			//rebuild offset - 1 from its bucket and extra bits, see OffsetCode
+			uint8_t bucket = code - REP_CODES;
+			uint32_t value = bucket;
+			if (bucket >= 4)
+			{
+				uint8_t extraCount = bucket / 2 - 1;
+				if (bucket >= 64
+					|| extraPos + extraCount > extraBitCount)
+				{
+					ForceClose(
+						"Malformed offset in LZSS stream for archive '" + target + "' (corruption suspected)!\n",
+						ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+					return;
+				}
+
+				uint32_t extra = 0;
+				for (uint8_t i = 0; i < extraCount; i++)
+				{
+					extra = (extra << 1) | ((extraBits[extraPos >> 3] >> (7 - (extraPos & 7))) & 1);
+					extraPos++;
+				}
+
+				value = ((2u | (bucket & 1)) << extraCount) | extra;
+			}
+
+			offset = static_cast<size_t>(value) + 1;
+		}
+		reps.Use(offset);
+
+		if (!IsValidMatch(offset, length, written, originalSize, target)) return;
+
+		uint8_t* dst = out.ReserveMatch(written, offset, length, target);
+		if (dst == nullptr) return;
+
+		Simd::CopyMatch(dst, offset, length);
+		written += length;
+	}
+
+	if (literalPos != literals.size()
+		|| matchPos != lengths.size()
+		|| matchPos != offsetCodes.size())
+	{
+		ForceClose(
+			"Unused tokens left after decompressing '" + target + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+		return;
+	}
+
+	out.Finish();
+}
+
+vector<uint8_t> EncodeAdaptive(
+	span<const uint8_t> input,
+	const TokenStreams& streams)
+{
+	RangeEncoder encoder{};
+	unique_ptr<TokenModel> model = make_unique<TokenModel>(input.size());
+
+	size_t pos = 0;
+	size_t token = 0;
+	size_t literalPos = 0;
+	size_t matchPos = 0;
+	size_t extraPos = 0;
+
+	RepHistory reps{};
+
+	while (pos < input.size())
+	{
+		bool isMatch = (streams.control[token >> 3] >> (token & 7)) & 1;
+		token++;
+
+		model->isMatch[model->state].Encode(encoder, isMatch);
+
+		if (!isMatch)
+		{
+			uint8_t prev1 = pos > 0 ? input[pos - 1] : 0;
+			uint8_t prev2 = pos > 1 ? input[pos - 2] : 0;
+			uint8_t expected = pos >= reps.offsets[0] ? input[pos - reps.offsets[0]] : 0;
+
+			model->literals.Encode(
+				encoder,
+				streams.literals[literalPos++],
+				prev1,
+				prev2,
+				expected,
+				model->state & 1);
+
+			model->state = (model->state << 1) & 7;
+			pos++;
+			continue;
+		}
+
+		uint8_t len8 = streams.lengths[matchPos];
+		uint8_t code = streams.offsetCodes[matchPos];
+		matchPos++;
+
+		model->lengths[model->state & 1].Encode(encoder, len8);
+		model->offsetCodes[len8 < 3 ? len8 : 3].Encode(encoder, code);
+
+		//the offset itself is only needed to track the recent offsets
+		uint8_t bucket = code - REP_CODES;
+		size_t offset = (code < REP_CODES) ? reps.offsets[code] : (size_t)bucket + 1;
+		if (code >= REP_CODES
+			&& bucket >= 4)
+		{
+			uint8_t extraCount = bucket / 2 - 1;
+
+			uint32_t extra = 0;
+			for (uint8_t i = 0; i < extraCount; i++)
+			{
+				extra = (extra << 1) | ((streams.extraBits[extraPos >> 3] >> (7 - (extraPos & 7))) & 1);
+				extraPos++;
+			}
+
+			for (uint8_t i = extraCount; i-- > 4;)
+			{
+				encoder.Encode((extra >> i) & 1, 2048);
+			}
+			if (extraCount >= 4) model->align.Encode(encoder, extra & 0xF);
+			else model->shortExtra[bucket - 4].Encode(encoder, extra);
+
+			offset = static_cast<size_t>(((2u | (bucket & 1)) << extraCount) | extra) + 1;
+		}
+		reps.Use(offset);
+
+		model->state = ((model->state << 1) | 1) & 7;
+		pos += len8 + MIN_MATCH;
+	}
+
+	encoder.Flush();
+	return move(encoder.GetOutput());
+}
+
+bool AddChunkTasks(
+	ifstream& in,
+	const ExtractTask& entry,
+	vector<ExtractTask>& tasks,
+	const string& origin)
+{
+	uint32_t chunkCount{};
+	uint32_t chunkSize{};
+	if (entry.storedSize < CHUNK_TABLE_HEADER
+		|| !in.read((char*)&chunkCount, sizeof(uint32_t))
+		|| !in.read((char*)&chunkSize, sizeof(uint32_t)))
+	{
+		ForceClose(
+			"Unexpected end of archive while reading chunk table for '" + entry.relPath + "' in archive '" + origin + "'!\n",
+			ForceCloseType::TYPE_DECOMPRESSION);
+
+		return false;
+	}
+
+	//the chunk size and file size decide how many chunks there are,
+	//no writer ever splits files into chunks larger than CHUNK_SIZE_MAX
+	if (chunkSize == 0
+		|| chunkSize > CHUNK_SIZE_MAX
+		|| chunkCount != (entry.originalSize + chunkSize - 1) / chunkSize
+		|| chunkCount > (entry.storedSize - CHUNK_TABLE_HEADER) / CHUNK_TABLE_ENTRY)
+	{
+		ForceClose(
+			"Invalid chunk table for '" + entry.relPath + "' in archive '" + origin + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_DECOMPRESSION);
+
+		return false;
+	}
+
+	vector<uint8_t> table((size_t)chunkCount * CHUNK_TABLE_ENTRY);
+	if (!in.read((char*)table.data(), static_cast<streamsize>(table.size())))
+	{
+		ForceClose(
+			"Unexpected end of archive while reading chunk table for '" + entry.relPath + "' in archive '" + origin + "'!\n",
+			ForceCloseType::TYPE_DECOMPRESSION);
+
+		return false;
+	}
+
+	uint64_t payloadStart = entry.storedOffset + CHUNK_TABLE_HEADER + table.size();
+	uint64_t payloadSize = entry.storedSize - CHUNK_TABLE_HEADER - table.size();
+
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		const uint8_t* item = table.data() + i * CHUNK_TABLE_ENTRY;
+
+		ExtractTask task = entry;
+		task.method = item[0];
+		task.create = false;
+		uint64_t offset{};
+		memcpy(&offset, item + sizeof(uint8_t), sizeof(uint64_t));
+		memcpy(&task.storedSize, item + sizeof(uint8_t) + sizeof(uint64_t), sizeof(uint64_t));
+
+		task.outputOffset = i * (uint64_t)chunkSize;
+		task.originalSize = (entry.originalSize - task.outputOffset < chunkSize)
+			? entry.originalSize - task.outputOffset
+			: chunkSize;
+
+		if (offset > payloadSize
+			|| task.storedSize > payloadSize - offset)
+		{
+			ForceClose(
+				"Chunk points past the end of '" + entry.relPath + "' in archive '" + origin + "' (corruption suspected)!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return false;
+		}
+		task.storedOffset = payloadStart + offset;
+
+		//chunks are raw, split streams or range coded, and only compressed if that made them smaller
+		bool valid = task.method == 0
+			? task.storedSize == task.originalSize
+			: (task.method == 3 || task.method == 4) && task.storedSize < task.originalSize;
+
+		if (!valid)
+		{
+			ForceClose(
+				"Invalid chunk method '" + to_string(task.method) + "' for '" + entry.relPath + "' in archive '" + origin + "' (corruption suspected)!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return false;
+		}
+
+		tasks.push_back(task);
+	}
+
+	return true;
+}
+
+bool ExtractParts(
+	const vector<ExtractTask>& tasks,
+	size_t first,
+	size_t count,
+	int version,
+	const string& origin)
+{
+	//outputs larger than any chunk are never held whole, workers only ever claim them one at a time
+	if (count == 1
+		&& tasks[first].originalSize > STREAM_OUTPUT_LIMIT)
+	{
+		return ExtractStreamed(tasks[first], version, origin);
+	}
+
+	//every batch reads from its own positions, so no stream is shared between workers
+	vector<vector<uint8_t>> payloads(count);
+	vector<FileRequest> reads(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const ExtractTask& task = tasks[first + i];
+		payloads[i].resize(static_cast<size_t>(task.storedSize));
+
+		reads[i].file = origin;
+		reads[i].offset = task.storedOffset;
+		reads[i].data = payloads[i].data();
+		reads[i].size = task.storedSize;
+	}
+	FileIO::ReadBatch(reads);
 
-				ss << "Decompressed archive file '" << target << "' size '" << data.size()
-					<< "does not match original size '" << originalSize << "'!\n";
+	vector<vector<uint8_t>> outputs(count);
+	vector<FileRequest> writes(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const ExtractTask& task = tasks[first + i];
 
-				ForceClose(
-					ss.str(),
-					ForceCloseType::TYPE_DECOMPRESSION);
+		if (!reads[i].ok
+			|| reads[i].transferred != task.storedSize)
+		{
+			ForceClose(
+				"Unexpected end of archive while reading data for '" + task.relPath + "' in archive '" + origin + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
 
-				return;
-			}
+			return false;
+		}
+
+		if (!DecodePart(task, payloads[i], outputs[i], version, origin)) return false;
+		payloads[i] = vector<uint8_t>();
+
+		writes[i].file = task.outPath;
+		writes[i].offset = task.outputOffset;
+		writes[i].data = outputs[i].data();
+		writes[i].size = task.originalSize;
+		writes[i].create = task.create;
+	}
+
+	//write every part at its place in its file
+	FileIO::WriteBatch(writes);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!writes[i].ok)
+		{
+			ForceClose(
+				"Failed to extract file '" + tasks[first + i].relPath + "' from archive '" + origin + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION);
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool DecodePart(
+	const ExtractTask& task,
+	vector<uint8_t>& payload,
+	vector<uint8_t>& data,
+	int version,
+	const string& origin)
+{
+	//raw: the stored bytes are the file
+	if (task.method == 0) data = move(payload);
+	else
+	{
+		OutputWindow window(static_cast<size_t>(task.originalSize));
+		DecodeStored(task, payload, window, version, origin);
+		window.TakeOutput(data);
+	}
+
+	//sanity check
+	if (data.size() != task.originalSize)
+	{
+		ostringstream ss{};
+
+		ss << "Decompressed size '" << data.size() << "' of '" << task.relPath
+			<< "' does not match original size '" << task.originalSize << "'!\n";
+
+		ForceClose(
+			ss.str(),
+			ForceCloseType::TYPE_DECOMPRESSION);
+
+		return false;
+	}
+
+	return true;
+}
+
+bool ExtractStreamed(
+	const ExtractTask& task,
+	int version,
+	const string& origin)
+{
+	size_t originalSize = static_cast<size_t>(task.originalSize);
+
+	ifstream in(origin, ios::binary);
+	in.seekg(static_cast<streamoff>(task.storedOffset));
+
+	OutputWindow window(
+		originalSize,
+		task.outPath,
+		task.outputOffset,
+		task.create);
+
+	if (task.method == 0)
+	{
+		//raw: copy the stored bytes over a piece at a time
+		size_t written = 0;
+		while (written < originalSize)
+		{
+			size_t piece = min(originalSize - written, STREAM_FLUSH_SIZE);
 
-			//write file
-			ofstream outFile(outPath, ios::binary);
-			outFile.write((char*)data.data(), data.size());
-			if (!outFile.good())
+			uint8_t* dst = window.Reserve(written, piece);
+			if (dst == nullptr) return false;
+
+			in.read(reinterpret_cast<char*>(dst), static_cast<streamsize>(piece));
+			if (in.gcount() != static_cast<streamsize>(piece))
 			{
 				ForceClose(
-					"Failed to extract file '" + relPath + "' from archive '" + origin + "' into target folder '" + target + "'!\n",
+					"Unexpected end of archive while reading data for '" + task.relPath + "' in archive '" + origin + "'!\n",
 					ForceCloseType::TYPE_DECOMPRESSION);
-				return;
-			}
 
-			//done writing
-			outFile.close();
+				return false;
+			}
+			written += piece;
 		}
 
-		//end timer
-		auto end = high_resolution_clock::now();
-		auto durationSec = duration<double>(end - start).count();
+		return window.Finish();
+	}
 
-		uint64_t folderSize{};
-		for (auto& p : recursive_directory_iterator(target))
-		{
-			if (is_regular_file(p)) folderSize += file_size(p);
-		}
+	//version 01 writers coded method 1 payloads with a Huffman tree and never split files,
+	//so these are decoded while they are read and neither the payload nor its tokens are held whole
+	int mode = in.peek();
+	if (task.method == 1
+		&& (mode == HUFFMAN_MODE_DENSE
+		|| mode == HUFFMAN_MODE_SPARSE))
+	{
+		PayloadReader payload(in, task.storedSize);
 
-		auto archiveSize = file_size(origin);
-		auto mbps = static_cast<double>(archiveSize) / (1024.0 * 1024.0) / durationSec;
+		uint8_t modeByte{};
+		payload.Take(modeByte);
 
-		auto ratio = (static_cast<double>(folderSize) / archiveSize) * 100.0;
-		auto factor = static_cast<double>(folderSize) / archiveSize;
-		auto saved = 100.0 - ratio;
+		size_t symbolCount{};
+		unique_ptr<HuffNode> root = ReadHuffmanTree(payload, modeByte, symbolCount, origin);
+		if (!root) return false;
 
-		ostringstream finishDecomp{};
+		TreeSource tokens(payload, root.get(), symbolCount);
+		DecompressTokens(
+			tokens,
+			window,
+			originalSize,
+			version,
+			origin);
 
-		if (Core::IsVerboseLoggingEnabled())
+		return window.IsFinished();
+	}
+
+	//every other payload comes from a version 02 writer, which keeps files whole only up to
+	//the in-flight limit, so the stored bytes are still read whole and only the output is held in a window
+	vector<uint8_t> payload(static_cast<size_t>(task.storedSize));
+	in.read(reinterpret_cast<char*>(payload.data()), static_cast<streamsize>(payload.size()));
+	if (in.gcount() != static_cast<streamsize>(payload.size()))
+	{
+		ForceClose(
+			"Unexpected end of archive while reading data for '" + task.relPath + "' in archive '" + origin + "'!\n",
+			ForceCloseType::TYPE_DECOMPRESSION);
+
+		return false;
+	}
+
+	DecodeStored(task, payload, window, version, origin);
+
+	return window.IsFinished();
+}
+
+void DecodeStored(
+	const ExtractTask& task,
+	const vector<uint8_t>& payload,
+	OutputWindow& out,
+	int version,
+	const string& origin)
+{
+	if (task.method == 1)
+	{
+		vector<uint8_t> lzssStream = HuffmanDecode(
+			payload.data(),
+			payload.size(),
+			origin);
+
+		//decompress
+		BufferSource tokens(lzssStream);
+		DecompressTokens(
+			tokens,
+			out,
+			static_cast<size_t>(task.originalSize),
+			version,
+			origin);
+	}
+	else if (task.method == 4)
+	{
+		DecompressAdaptive(
+			payload,
+			out,
+			static_cast<size_t>(task.originalSize),
+			origin);
+	}
+	else
+	{
+		DecompressStreams(
+			payload,
+			out,
+			static_cast<size_t>(task.originalSize),
+			task.method == 3,
+			origin);
+	}
+}
+
+string DescribeFileIO()
+{
+	FileIOStats io = FileIO::GetStats();
+	double average = io.files > 0 ? io.latencyTotal / io.files : 0.0;
+
+	ostringstream ss{};
+
+	//only files read or written in batches are counted, not the archive itself or files streamed to and from it
+	ss << "  - batched file I/O: " << FileIO::GetBackendName() << ", "
+		<< (io.estimated ? "about " : "") << io.syscalls << " system calls for " << io.files << " files\n"
+		<< "  - per-file latency: average " << fixed << setprecision(3) << average * 1000.0 << "ms, "
+		<< "max " << fixed << setprecision(3) << io.latencyMax * 1000.0 << "ms\n";
+
+	return ss.str();
+}
+
+void DecompressAdaptive(
+	const vector<uint8_t>& payload,
+	OutputWindow& out,
+	size_t originalSize,
+	const string& target)
+{
+	//skip decompressing empty file
+	if (originalSize == 0)
+	{
+		out.Finish();
+		return;
+	}
+
+	RangeDecoder decoder(payload.data(), payload.size());
+	unique_ptr<TokenModel> model = make_unique<TokenModel>(originalSize);
+
+	size_t written = 0;
+
+	RepHistory reps{};
+
+	while (written < originalSize)
+	{
+		bool isMatch = model->isMatch[model->state].Decode(decoder);
+
+		if (!isMatch) //literal
 		{
-			finishDecomp 
-				<< "Finished decompressing archive '" << origin << "' to folder '" << target << "'!\n"
-				<< "  - origin archive size: " << archiveSize << " bytes\n"
-				<< "  - target folder size: " << folderSize << " bytes\n"
-				<< "  - expansion ratio: " << fixed << setprecision(2) << ratio << "%\n"
-				<< "  - expansion factor: " << fixed << setprecision(2) << factor << "x\n"
-				<< "  - throughput: " << fixed << setprecision(2) << mbps << " MB/s\n"
-				<< "  - total files: " << fileCount << "\n"
-				<< "  - decompressed: " << compCount << "\n"
-				<< "  - unpacked raw: " << rawCount << "\n"
-				<< "  - empty: " << emptyCount << "\n"
-				<< "  - duration: " << fixed << setprecision(2) << durationSec << " seconds\n";
+			uint8_t prev1 = written > 0 ? out.At(written - 1) : 0;
+			uint8_t prev2 = written > 1 ? out.At(written - 2) : 0;
+			uint8_t expected = written >= reps.offsets[0] ? out.At(written - reps.offsets[0]) : 0;
+
+			uint8_t* dst = out.Reserve(written, 1);
+			if (dst == nullptr) return;
+
+			*dst = model->literals.Decode(
+				decoder,
+				prev1,
+				prev2,
+				expected,
+				model->state & 1);
+			written++;
+
+			model->state = (model->state << 1) & 7;
+			continue;
 		}
+
+		//reference
+		uint8_t len8 = (uint8_t)model->lengths[model->state & 1].Decode(decoder);
+		uint8_t code = (uint8_t)model->offsetCodes[len8 < 3 ? len8 : 3].Decode(decoder);
+
+		size_t length = len8 + MIN_MATCH;
+
+		size_t offset{};
+		if (code < REP_CODES) offset = reps.offsets[code];
 		else
 		{
-			finishDecomp 
-				<< "Finished decompressing archive '" << path(origin).filename().string()
-				<< "' to folder '" << path(target).filename().string() << "'!\n"
-				<< "  - origin archive size: " << archiveSize << " bytes\n"
-				<< "  - target folder size: " << folderSize << " bytes\n"
-				<< "  - throughput: " << fixed << setprecision(2) << mbps << " MB/s\n"
-				<< "  - duration: " << fixed << setprecision(2) << durationSec << " seconds\n";
+			//rebuild offset - 1 from its bucket and extra bits, see OffsetCode
+			uint8_t bucket = code - REP_CODES;
+			uint32_t value = bucket;
+			if (bucket >= 4)
+			{
+				if (bucket >= 64)
+				{
+					ForceClose(
+						"Malformed offset in LZSS stream for archive '" + target + "' (corruption suspected)!\n",
+						ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+					return;
+				}
+				uint8_t extraCount = bucket / 2 - 1;
+
+				uint32_t extra = 0;
+				if (extraCount >= 4)
+				{
+					for (uint8_t i = extraCount; i-- > 4;)
+					{
+						extra = (extra << 1) | decoder.Decode(2048);
+					}
+					extra = (extra << 4) | model->align.Decode(decoder);
+				}
+				else extra = model->shortExtra[bucket - 4].Decode(decoder);
+
+				//short trees can decode more bits than the bucket has
+				if (extra >> extraCount)
+				{
+					ForceClose(
+						"Malformed offset in LZSS stream for archive '" + target + "' (corruption suspected)!\n",
+						ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+					return;
+				}
+
+				value = ((2u | (bucket & 1)) << extraCount) | extra;
+			}
+
+			offset = static_cast<size_t>(value) + 1;
 		}
+		reps.Use(offset);
 
-		Core::PrintMessage(
-			finishDecomp.str(),
-			MessageType::MESSAGETYPE_SUCCESS);
+		if (!IsValidMatch(offset, length, written, originalSize, target)) return;
 
-		Command::SetCommandAllowState(true);
+		uint8_t* dst = out.ReserveMatch(written, offset, length, target);
+		if (dst == nullptr) return;
+
+		Simd::CopyMatch(dst, offset, length);
+		written += length;
+
+		model->state = ((model->state << 1) | 1) & 7;
+	}
+
+	if (decoder.IsOverrun())
+	{
+		ForceClose(
+			"Unexpected end of range coded stream in '" + target + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+		return;
 	}
+
+	out.Finish();
 }
 
-void ForceClose(
-	const string& message,
-	ForceCloseType type)
+template <typename Source>
+void DecompressTokens(
+	Source& tokens,
+	OutputWindow& out,
+	size_t originalSize,
+	int version,
+	const string& target)
 {
-	string title{};
+	//skip decompressing empty file
+	if (originalSize == 0)
+	{
+		out.Finish();
+		return;
+	}
 
-	switch (type)
+	size_t written = 0;
+
+	bool decoded = (version == LEGACY_ARCHIVE_VERSION)
+		? DecodeLegacyTokens(tokens, out, originalSize, written, target)
+		: DecodePackedTokens(tokens, out, originalSize, written, target);
+
+	if (!decoded) return;
+
+	if (written != originalSize) 
 	{
-	case ForceCloseType::TYPE_COMPRESSION:
-		title = "Compression error";
-		break;
-	case ForceCloseType::TYPE_DECOMPRESSION:
-		title = "Decompression error";
-		break;
-	case ForceCloseType::TYPE_COMPRESSION_BUFFER:
-		title = "Compression buffer error";
-		break;
-	case ForceCloseType::TYPE_DECOMPRESSION_BUFFER:
-		title = "Decompression buffer error";
-		break;
-	case ForceCloseType::TYPE_HUFFMAN_ENCODE:
-		title = "Huffman encode error";
-		break;
-	case ForceCloseType::TYPE_HUFFMAN_DECODE:
-		title = "Huffman decode error";
-		break;
+		ostringstream ss{};
+
+		ss << "Decompressed size '" << written
+			<< "' does not match expected size '" << originalSize
+			<< "' for archive '" << target << "' (possible corruption)!\n";
+
+		ForceClose(
+			ss.str(),
+			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+		return;
 	}
 
-	Core::ForceClose(title, message);
+	out.Finish();
 }
 
-vector<uint8_t> CompressBuffer(
-	const vector<uint8_t>& input,
-	const string& origin)
+template <typename Source>
+bool DecodeLegacyTokens(
+	Source& tokens,
+	OutputWindow& out,
+	size_t originalSize,
+	size_t& written,
+	const string& target)
 {
-	size_t windowSize = Compress::GetWindowSize();
-	size_t lookAhead = Compress::GetLookAhead();
+	uint8_t flag{};
+	while (tokens.Take(flag))
+	{
+		if (flag == 1) //literal
+		{
+			uint8_t literal{};
+			if (!tokens.Take(literal))
+			{
+				ForceClose(
+					"Unexpected end of LZSS stream while reading literal in '" + target + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
 
-	vector<uint8_t> output{};
+				return false;
+			}
+			if (written >= originalSize)
+			{
+				ostringstream ss{};
 
-	if (input.empty()) return output;
+				ss << "Decompressed size '" << written + 1 << "' "
+					<< "exceeds expected size '" << originalSize << "' "
+					<< "while reading archive '" << target << "'!\n";
+
+				ForceClose(
+					ss.str(),
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+				return false;
+			}
+
+			uint8_t* dst = out.Reserve(written, 1);
+			if (dst == nullptr) return false;
+
+			*dst = literal;
+			written++;
+		}
+		else //reference
+		{
+			uint8_t reference[sizeof(uint32_t) + sizeof(uint8_t)]{};
+			if (!tokens.Take(reference, sizeof(reference)))
+			{
+				ForceClose(
+					"Unexpected end of LZSS stream while reading reference in '" + target + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+				return false;
+			}
+
+			uint32_t offset{};
+			memcpy(&offset, reference, sizeof(uint32_t));
+
+			uint8_t length = reference[sizeof(uint32_t)];
+
+			if (!IsValidMatch(offset, length, written, originalSize, target)) return false;
+
+			uint8_t* dst = out.ReserveMatch(written, offset, length, target);
+			if (dst == nullptr) return false;
+
+			Simd::CopyMatch(dst, offset, length);
+			written += length;
+		}
+	}
+
+	return true;
+}
 
-	size_t pos = 0;
+template <typename Source>
+bool DecodePackedTokens(
+	Source& tokens,
+	OutputWindow& out,
+	size_t originalSize,
+	size_t& written,
+	const string& target)
+{
+	uint8_t control = 0;
+	uint8_t controlBit = 8;
 
-	while (pos < input.size())
+	//the last control byte may have unused bits, so the output size decides when to stop
+	while (written < originalSize)
 	{
-		size_t bestLength = 0;
-		size_t bestOffset = 0;
-		size_t start = (pos > windowSize) ? (pos - windowSize) : 0;
-
-		//search backwards in window
-		for (size_t i = start; i < pos; i++)
+		if (controlBit == 8)
 		{
-			size_t length = 0;
-
-			while (length < lookAhead
-				&& pos + length < input.size()
-				&& input[i + length] == input[pos + length])
+			if (!tokens.Take(control))
 			{
-				length++;
-			}
+				ForceClose(
+					"Unexpected end of LZSS stream while reading control byte in '" + target + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
 
-			if (length > bestLength
-				&& length >= MIN_MATCH)
-			{
-				bestLength = length;
-				bestOffset = pos - i;
+				return false;
 			}
+			controlBit = 0;
 		}
 
-		if (bestLength >= MIN_MATCH)
+		bool isMatch = (control >> controlBit++) & 1;
+
+		if (!isMatch) //literal
 		{
-			if (bestOffset >= UINT32_MAX)
+			uint8_t literal{};
+			if (!tokens.Take(literal))
 			{
 				ForceClose(
-					"Offset too large for file '" + origin + "' during compressing (data window exceeded)!\n",
-					ForceCloseType::TYPE_COMPRESSION_BUFFER);
+					"Unexpected end of LZSS stream while reading literal in '" + target + "'!\n",
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
 
-				return {};
+				return false;
 			}
 
-			uint8_t flag = 0;
-			output.push_back(flag);
+			uint8_t* dst = out.Reserve(written, 1);
+			if (dst == nullptr) return false;
+
+			*dst = literal;
+			written++;
+			continue;
+		}
+
+		//reference: length byte, then offset - 1 as a little endian base-128 varint
+		uint8_t lengthCode{};
+		if (!tokens.Take(lengthCode))
+		{
+			ForceClose(
+				"Unexpected end of LZSS stream while reading reference in '" + target + "'!\n",
+				ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+			return false;
+		}
 
-			uint32_t offset = (uint32_t)bestOffset;
-			output.insert(output.end(),
-				reinterpret_cast<uint8_t*>(&offset),
-				reinterpret_cast<uint8_t*>(&offset) + sizeof(uint32_t));
+		size_t length = lengthCode + MIN_MATCH;
 
-			if (bestLength > UINT8_MAX)
+		uint64_t value = 0;
+		for (int shift = 0;; shift += 7)
+		{
+			uint8_t b{};
+			if (shift > 28
+				|| !tokens.Take(b))
 			{
 				ForceClose(
-					"Match length too large for file '" + origin + "' during compressing (overflow)!\n",
-					ForceCloseType::TYPE_COMPRESSION_BUFFER);
+					"Malformed offset in LZSS stream for archive '" + target + "' (corruption suspected)!\n",
+					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
 
-				return {};
+				return false;
 			}
 
-			uint8_t len8 = (uint8_t)bestLength;
-			output.push_back(len8);
+			value |= static_cast<uint64_t>(b & 0x7F) << shift;
 
-			pos += bestLength;
-		}
-		else
-		{
-			uint8_t flag = 1;
-			output.push_back(flag);
-			output.push_back(input[pos]);
-			pos++;
+			if ((b & 0x80) == 0) break;
 		}
+
+		size_t offset = static_cast<size_t>(value) + 1;
+
+		if (!IsValidMatch(offset, length, written, originalSize, target)) return false;
+
+		uint8_t* dst = out.ReserveMatch(written, offset, length, target);
+		if (dst == nullptr) return false;
+
+		Simd::CopyMatch(dst, offset, length);
+		written += length;
 	}
 
-	if (output.empty())
+	if (!tokens.IsDone())
 	{
 		ForceClose(
-			"Compression produced empty output for file '" + origin + "' (unexpected)!\n",
-			ForceCloseType::TYPE_COMPRESSION_BUFFER);
+			"Trailing data after the last token in LZSS stream for archive '" + target + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+		return false;
 	}
 
-	return output;
+	return true;
 }
 
-void DecompressBuffer(
-	const vector<uint8_t>& lzssStream,
-	vector<uint8_t>& out,
+bool IsValidMatch(
+	size_t offset,
+	size_t length,
+	size_t written,
 	size_t originalSize,
 	const string& target)
 {
-	//skip decompressing empty file
-	if (originalSize == 0)
+	if (offset == 0)
 	{
-		out.clear();
-		return;
+		ostringstream ss{};
+
+		ss << "Offset size is '0' in LZSS stream for archive '" << target << "' (corruption suspected)!\n";
+
+		ForceClose(
+			ss.str(),
+			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+
+		return false;
 	}
+	if (offset > written)
+	{
+		ostringstream ss{};
 
-	vector<uint8_t> buffer{};
-	buffer.reserve(originalSize);
+		ss << "Offset size '" << offset << "' is bigger than buffer size '"
+			<< written << "' in LZSS stream for archive '" << target << "' (corruption suspected)!\n";
 
-	size_t pos = 0;
+		ForceClose(
+			ss.str(),
+			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
 
-	while (pos < lzssStream.size())
+		return false;
+	}
+	if (written + length > originalSize)
 	{
-		uint8_t flag = lzssStream[pos++];
+		ostringstream ss{};
 
-		if (flag == 1) //literal
-		{
-			if (pos >= lzssStream.size())
-			{
-				ForceClose(
-					"Unexpected end of LZSS stream while reading literal in '" + target + "'!\n",
-					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+		ss << "Decompressed size '" << written + length << "' "
+			<< "exceeds expected size '" << originalSize << "' "
+			<< "while reading archive '" << target << "'!\n";
 
-				return;
-			}
+		ForceClose(
+			ss.str(),
+			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
 
-			uint8_t c = lzssStream[pos++];
-			buffer.push_back(c);
-		}
-		else //reference
-		{
-			if (pos + sizeof(uint16_t) + sizeof(uint8_t) > lzssStream.size())
+		return false;
+	}
+
+	return true;
+}
+
+unique_ptr<HuffNode> BuildTree(const size_t freq[256])
+{
+	priority_queue<unique_ptr<HuffNode>, vector<unique_ptr<HuffNode>>, NodeCompare> pq{};
+	for (int i = 0; i < 256; i++)
+	{
+		if (freq[i] > 0) pq.push(make_unique<HuffNode>((uint8_t)i, freq[i]));
+	}
+	if (pq.empty()) return nullptr;
+	if (pq.size() == 1) pq.push(make_unique<HuffNode>(0, 1));
+
+	while (pq.size() > 1)
+	{
+		auto ExtractTop = [&](auto& q)
 			{
-				ForceClose(
-					"Unexpected end of LZSS stream while reading reference in '" + target + "'!\n",
-					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+				unique_ptr<HuffNode> node = move(const_cast<unique_ptr<HuffNode>&>(q.top()));
+				q.pop();
+				return node;
+			};
 
-				return;
-			}
+		auto left = ExtractTop(pq);
+		auto right = ExtractTop(pq);
 
-			uint32_t offset = *reinterpret_cast<const uint32_t*>(&lzssStream[pos]);
-			pos += sizeof(uint32_t);
+		auto merged = make_unique<HuffNode>(move(left), move(right));
+		pq.push(move(merged));
+	}
 
-			uint8_t length = lzssStream[pos++];
+	return move(const_cast<unique_ptr<HuffNode>&>(pq.top()));
+}
 
-			if (offset == 0)
-			{
-				ostringstream ss{};
+void BuildCodeLengths(
+	HuffNode* node,
+	uint8_t depth,
+	uint8_t lengths[256])
+{
+	if (!node->left
+		&& !node->right)
+	{
+		lengths[node->symbol] = depth == 0 ? 1 : depth;
+	}
 
-				ss << "Offset size is '0' in LZSS stream for archive '" << target << "' (corruption suspected)!\n";
+	if (node->left) BuildCodeLengths(node->left.get(), depth + 1, lengths);
+	if (node->right) BuildCodeLengths(node->right.get(), depth + 1, lengths);
+}
 
-				ForceClose(
-					ss.str(),
-					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+void BuildLimitedCodeLengths(
+	const size_t freq[256],
+	uint8_t lengths[256],
+	uint8_t maxLength)
+{
+	//package-merge: every level holds the symbols plus the pairs of the level below,
+	//cheapest first. Picking the 2n - 2 cheapest items of the last level and following
+	//the pairs back down gives each symbol one bit of code length per level it appears in
+	struct Item
+	{
+		uint64_t weight;
+		int symbol; //-1 for a pair of items from the level below
+	};
 
-				return;
-			}
-			if (offset > buffer.size())
-			{
-				ostringstream ss{};
+	for (int i = 0; i < 256; i++) lengths[i] = 0;
 
-				ss << "Offset size '" << offset << "' is bigger than buffer size '"
-					<< buffer.size() << "' in LZSS stream for archive '" << target << "' (corruption suspected)!\n";
+	vector<Item> leaves{};
+	for (int i = 0; i < 256; i++)
+	{
+		if (freq[i] > 0) leaves.push_back({ freq[i], i });
+	}
+	if (leaves.empty()) return;
 
-				ForceClose(
-					ss.str(),
-					ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+	//a lone symbol still needs one bit
+	if (leaves.size() == 1)
+	{
+		lengths[leaves[0].symbol] = 1;
+		return;
+	}
 
-				return;
-			}
+	stable_sort(
+		leaves.begin(),
+		leaves.end(),
+		[](const Item& a, const Item& b) { return a.weight < b.weight; });
 
-			size_t start = buffer.size() - offset;
-			for (size_t i = 0; i < length; i++)
-			{
-				if (buffer.size() >= originalSize)
-				{
-					ostringstream ss{};
+	vector<vector<Item>> levels(maxLength);
+	levels[0] = leaves;
 
-					ss << "Decompressed size '" << buffer.size() << "' "
-						<< "exceeds expected size '" << originalSize << "' "
-						<< "while reading archive '" << target << "'!\n";
+	for (uint8_t level = 1; level < maxLength; level++)
+	{
+		const vector<Item>& below = levels[level - 1];
+		vector<Item>& current = levels[level];
+		current.reserve(leaves.size() * 2);
 
-					ForceClose(
-						ss.str(),
-						ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+		size_t leaf = 0;
+		size_t pair = 0;
+		size_t pairCount = below.size() / 2;
 
-					return;
-				}
-				buffer.push_back(buffer[start + i]);
+		while (leaf < leaves.size()
+			|| pair < pairCount)
+		{
+			uint64_t pairWeight = (pair < pairCount)
+				? below[pair * 2].weight + below[pair * 2 + 1].weight
+				: UINT64_MAX;
+
+			if (leaf < leaves.size()
+				&& leaves[leaf].weight <= pairWeight)
+			{
+				current.push_back(leaves[leaf++]);
+			}
+			else
+			{
+				current.push_back({ pairWeight, -1 });
+				pair++;
 			}
 		}
 	}
 
-	if (buffer.size() != originalSize) 
+	//walk down from the top level, each pair taken asks for two more items below it
+	size_t take = leaves.size() * 2 - 2;
+	for (int level = maxLength - 1; level >= 0; level--)
 	{
-		ostringstream ss{};
-
-		ss << "Decompressed size '" << buffer.size()
-			<< "' does not match expected size '" << originalSize
-			<< "' for archive '" << target << "' (possible corruption)!\n";
+		size_t pairs = 0;
+		for (size_t i = 0; i < take; i++)
+		{
+			const Item& item = levels[level][i];
 
-		ForceClose(
-			ss.str(),
-			ForceCloseType::TYPE_DECOMPRESSION_BUFFER);
+			if (item.symbol < 0) pairs++;
+			else lengths[item.symbol]++;
+		}
+		take = pairs * 2;
+	}
+}
 
-		return;
+void BuildCanonicalCodes(
+	const uint8_t lengths[256],
+	uint16_t codes[256])
+{
+	//codes of each length are consecutive and ordered by symbol,
+	//each length starts where the previous one ended, shifted left by one
+	uint16_t lengthCount[MAX_CODE_LENGTH + 1]{};
+	for (int i = 0; i < 256; i++) lengthCount[lengths[i]]++;
+	lengthCount[0] = 0;
+
+	uint16_t nextCode[MAX_CODE_LENGTH + 1]{};
+	uint16_t code = 0;
+	for (int length = 1; length <= MAX_CODE_LENGTH; length++)
+	{
+		code = (code + lengthCount[length - 1]) << 1;
+		nextCode[length] = code;
 	}
 
-	//hand decompressed data back to caller
-	out = move(buffer);
+	for (int i = 0; i < 256; i++)
+	{
+		codes[i] = (lengths[i] != 0) ? nextCode[lengths[i]]++ : 0;
+	}
 }
 
-void BuildCodes(
-	HuffNode* node,
-	const string& prefix,
-	map<uint8_t, string>& codes)
+bool BuildDecodeTable(
+	const uint8_t lengths[256],
+	HuffDecodeTable& table)
 {
-	if (!node->left
-		&& !node->right)
+	//a valid prefix code never uses more than the whole code space
+	uint32_t used = 0;
+	uint8_t maxLength = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		if (lengths[i] == 0) continue;
+
+		used += 1u << (MAX_CODE_LENGTH - lengths[i]);
+		if (lengths[i] > maxLength) maxLength = lengths[i];
+	}
+	if (used == 0
+		|| used > (1u << MAX_CODE_LENGTH))
+	{
+		return false;
+	}
+
+	uint16_t codes[256]{};
+	BuildCanonicalCodes(lengths, codes);
+
+	table.bits = maxLength;
+	table.entries.assign(size_t(1) << maxLength, 0);
+
+	for (int i = 0; i < 256; i++)
 	{
-		codes[node->symbol] = prefix.empty() ? "0" : prefix;
+		uint8_t length = lengths[i];
+		if (length == 0) continue;
+
+		//every index that starts with the code decodes to the symbol
+		uint16_t entry = (uint16_t)(i | (length << 8));
+		size_t first = (size_t)codes[i] << (maxLength - length);
+		size_t count = size_t(1) << (maxLength - length);
+		for (size_t j = 0; j < count; j++)
+		{
+			table.entries[first + j] = entry;
+		}
 	}
 
-	if (node->left) BuildCodes(node->left.get(), prefix + "0", codes);
-	if (node->right) BuildCodes(node->right.get(), prefix + "1", codes);
+	return true;
 }
 
 vector<uint8_t> HuffmanEncode(
@@ -978,16 +4482,31 @@ vector<uint8_t> HuffmanEncode(
 {
 	if (input.empty()) return {};
 
+	//long streams get a table per block so the code can follow changing content
+	if (input.size() > Compress::GetBlockSize()) return HuffmanEncodeBlocked(input, origin);
+
 	size_t freq[256]{};
 	for (auto b : input) freq[b]++;
 
-	//build priority queue
-	priority_queue<unique_ptr<HuffNode>, vector<unique_ptr<HuffNode>>, NodeCompare> pq{};
-	for (int i = 0; i < 256; i++)
-	{
-		if (freq[i] > 0) pq.push(make_unique<HuffNode>((uint8_t)i, freq[i]));
-	}
-	if (pq.empty())
+	uint8_t lengths[256]{};
+	BuildLimitedCodeLengths(freq, lengths, CODE_LENGTH_LIMIT);
+
+	uint16_t codes[256]{};
+	BuildCanonicalCodes(lengths, codes);
+
+	vector<uint8_t> output{};
+	output.reserve(input.size());
+
+	bool interleave = input.size() >= INTERLEAVE_MIN_SYMBOLS;
+	output.push_back(interleave ? HUFFMAN_MODE_INTERLEAVED : HUFFMAN_MODE_CANONICAL);
+
+	uint64_t symbolCount = input.size();
+	output.insert(
+		output.end(),
+		reinterpret_cast<uint8_t*>(&symbolCount),
+		reinterpret_cast<uint8_t*>(&symbolCount) + sizeof(uint64_t));
+
+	if (!WriteCodeLengths(lengths, output))
 	{
 		ForceClose(
 			"HuffmanEncode found no symbols in '" + origin + "'",
@@ -995,153 +4514,258 @@ vector<uint8_t> HuffmanEncode(
 
 		return {};
 	}
-	if (pq.size() == 1) pq.push(make_unique<HuffNode>(0, 1));
 
-	while (pq.size() > 1)
+	if (!WriteBitstreams(
+		input.data(),
+		input.size(),
+		lengths,
+		codes,
+		output,
+		origin))
 	{
-		auto ExtractTop = [&](auto& q)
+		return {};
+	}
+
+	return output;
+}
+
+vector<uint8_t> HuffmanEncodeBlocked(
+	const vector<uint8_t>& input,
+	const string& origin)
+{
+	size_t blockSize = Compress::GetBlockSize();
+
+	vector<uint8_t> output{};
+	output.reserve(input.size());
+
+	output.push_back(HUFFMAN_MODE_BLOCKED);
+
+	uint64_t symbolCount = input.size();
+	output.insert(
+		output.end(),
+		reinterpret_cast<uint8_t*>(&symbolCount),
+		reinterpret_cast<uint8_t*>(&symbolCount) + sizeof(uint64_t));
+
+	uint32_t blockSize32 = (uint32_t)blockSize;
+	output.insert(
+		output.end(),
+		reinterpret_cast<uint8_t*>(&blockSize32),
+		reinterpret_cast<uint8_t*>(&blockSize32) + sizeof(uint32_t));
+
+	uint8_t previous[256]{};
+	bool hasPrevious = false;
+
+	for (size_t begin = 0; begin < input.size(); begin += blockSize)
+	{
+		size_t count = (input.size() - begin < blockSize) ? input.size() - begin : blockSize;
+		const uint8_t* block = input.data() + begin;
+
+		size_t freq[256]{};
+		for (size_t i = 0; i < count; i++) freq[block[i]]++;
+
+		uint8_t lengths[256]{};
+		BuildLimitedCodeLengths(freq, lengths, CODE_LENGTH_LIMIT);
+
+		//a new table has to pay for its own lengths, so the previous one
+		//is kept for as long as the statistics barely change
+		int lastSymbol = 0;
+		for (int i = 0; i < 256; i++)
+		{
+			if (lengths[i] != 0) lastSymbol = i;
+		}
+		uint64_t tableBits = (uint64_t)(1 + lastSymbol / 2 + 1) * 8;
+
+		bool repeat = hasPrevious
+			&& CodedBits(freq, previous) <= CodedBits(freq, lengths) + tableBits;
+
+		if (repeat)
+		{
+			output.push_back(BLOCK_REPEAT_TABLE);
+			memcpy(lengths, previous, sizeof(lengths));
+		}
+		else
+		{
+			output.push_back(BLOCK_NEW_TABLE);
+			if (!WriteCodeLengths(lengths, output))
 			{
-				unique_ptr<HuffNode> node = move(const_cast<unique_ptr<HuffNode>&>(q.top()));
-				q.pop();
-				return node;
-			};
+				ForceClose(
+					"HuffmanEncode found no symbols in '" + origin + "'",
+					ForceCloseType::TYPE_HUFFMAN_ENCODE);
 
-		auto left = ExtractTop(pq);
-		auto right = ExtractTop(pq);
+				return {};
+			}
 
-		auto merged = make_unique<HuffNode>(move(left), move(right));
-		pq.push(move(merged));
+			memcpy(previous, lengths, sizeof(previous));
+			hasPrevious = true;
+		}
+
+		uint16_t codes[256]{};
+		BuildCanonicalCodes(lengths, codes);
+
+		//the byte size of the block goes in front of it once it is known
+		size_t sizePos = output.size();
+		output.resize(sizePos + sizeof(uint32_t));
+
+		if (!WriteBitstreams(
+			block,
+			count,
+			lengths,
+			codes,
+			output,
+			origin))
+		{
+			return {};
+		}
+
+		uint32_t blockBytes = (uint32_t)(output.size() - sizePos - sizeof(uint32_t));
+		memcpy(&output[sizePos], &blockBytes, sizeof(uint32_t));
 	}
-	unique_ptr<HuffNode> root = move(const_cast<unique_ptr<HuffNode>&>(pq.top()));
 
-	//build codes
-	map<uint8_t, string> codes{};
-	BuildCodes(root.get(), "", codes);
+	return output;
+}
+
+uint64_t CodedBits(
+	const size_t freq[256],
+	const uint8_t lengths[256])
+{
+	uint64_t bits = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		if (freq[i] == 0) continue;
+		if (lengths[i] == 0) return UINT64_MAX;
+
+		bits += (uint64_t)freq[i] * lengths[i];
+	}
+	return bits;
+}
 
-	//serialize frequency table
-	uint16_t nonZero = 0;
+bool WriteCodeLengths(
+	const uint8_t lengths[256],
+	vector<uint8_t>& output)
+{
+	//symbols past the highest used one are left out
+	int lastSymbol = -1;
 	for (int i = 0; i < 256; i++)
 	{
-		if (freq[i] > 0) nonZero++;
+		if (lengths[i] != 0) lastSymbol = i;
 	}
+	if (lastSymbol < 0) return false;
 
-	size_t denseSize = 256 * sizeof(uint32_t);                //always 1024
+	output.push_back((uint8_t)lastSymbol);
 
-	constexpr size_t entrySize = 5;
-	if (nonZero > (SIZE_MAX - sizeof(uint16_t)) / entrySize)
+	//two 4-bit lengths per byte, lower symbol in the low nibble
+	for (int i = 0; i <= lastSymbol; i += 2)
 	{
-		ForceClose(
-			"Sparse size overflow in '" + origin + "'!\n",
-			ForceCloseType::TYPE_HUFFMAN_ENCODE);
-
-		return {};
+		uint8_t high = (i + 1 < 256) ? lengths[i + 1] : 0;
+		output.push_back(lengths[i] | (high << 4));
 	}
-	size_t sparseSize = sizeof(uint16_t) + nonZero * entrySize; //count + (sym + freq)
 
+	return true;
+}
+
+bool ReadCodeLengths(
+	const uint8_t* data,
+	size_t size,
+	size_t& pos,
+	uint8_t lengths[256])
+{
+	if (pos >= size) return false;
 
-	bool useSparse = (sparseSize < denseSize);
+	size_t lastSymbol = data[pos++];
 
-	vector<uint8_t> output{};
-	uint8_t mode = useSparse ? 1 : 0;
-	output.push_back(mode);
+	size_t lengthBytes = lastSymbol / 2 + 1;
+	if (lengthBytes > size - pos) return false;
 
-	if (useSparse)
+	for (int i = 0; i < 256; i++) lengths[i] = 0;
+	for (size_t i = 0; i < lengthBytes; i++)
 	{
-		//write non-zero count
-		output.insert(
-			output.end(),
-			reinterpret_cast<uint8_t*>(&nonZero),
-			reinterpret_cast<uint8_t*>(&nonZero) + sizeof(uint16_t));
+		lengths[i * 2] = data[pos] & 0x0F;
+		lengths[i * 2 + 1] = data[pos] >> 4;
+		pos++;
+	}
 
-		//write each symbol + frequency
-		for (int i = 0; i < 256; i++)
-		{
-			if (freq[i] > 0)
-			{
-				uint8_t symbol = (uint8_t)i;
-				uint32_t f = (uint32_t)freq[i];
-				output.push_back(symbol);
-				output.insert(
-					output.end(),
-					reinterpret_cast<uint8_t*>(&f),
-					reinterpret_cast<uint8_t*>(&f) + sizeof(uint32_t));
-			}
-		}
+	return true;
+}
+
+bool WriteBitstreams(
+	const uint8_t* symbols,
+	size_t count,
+	const uint8_t lengths[256],
+	const uint16_t codes[256],
+	vector<uint8_t>& output,
+	const string& origin)
+{
+	//large inputs are cut into equal segments with a bitstream each,
+	//the last segment takes whatever is left
+	bool interleave = count >= INTERLEAVE_MIN_SYMBOLS;
+	size_t streamCount = interleave ? HUFFMAN_STREAMS : 1;
+	size_t segment = (count + streamCount - 1) / streamCount;
+
+	//the exact payload size is known up front, so the output is grown once
+	size_t streamBytes[HUFFMAN_STREAMS]{};
+	size_t payloadSize = 0;
+	for (size_t s = 0; s < streamCount; s++)
+	{
+		size_t begin = s * segment;
+		size_t end = (begin + segment < count) ? begin + segment : count;
+
+		uint64_t bits = 0;
+		for (size_t i = begin; i < end; i++) bits += lengths[symbols[i]];
+
+		streamBytes[s] = static_cast<size_t>((bits + 7) / 8);
+		payloadSize += streamBytes[s];
 	}
-	else
+
+	//jump table: byte size of every stream but the last
+	if (interleave)
 	{
-		//write dense table
-		for (int i = 0; i < 256; i++)
+		for (size_t s = 0; s < HUFFMAN_STREAMS - 1; s++)
 		{
-			uint32_t f = (uint32_t)freq[i];
+			uint32_t size = (uint32_t)streamBytes[s];
 			output.insert(
 				output.end(),
-				reinterpret_cast<uint8_t*>(&f),
-				reinterpret_cast<uint8_t*>(&f) + sizeof(uint32_t));
+				reinterpret_cast<uint8_t*>(&size),
+				reinterpret_cast<uint8_t*>(&size) + sizeof(uint32_t));
 		}
 	}
 
 	//bit-pack data
-	uint8_t bitbuf = 0;
-	int bitcount = 0;
-	vector<uint8_t> dataBits{};
+	size_t start = output.size();
+	output.resize(start + payloadSize);
 
-	for (auto b : input)
+	uint8_t* dst = output.data() + start;
+	for (size_t s = 0; s < streamCount; s++)
 	{
-		const auto it = codes.find(b);
-		if (it == codes.end())
-		{
-			ForceClose(
-				"HuffmanEncode missing code for symbol in '" + origin + "'!\n",
-				ForceCloseType::TYPE_HUFFMAN_ENCODE);
-
-			return {};
-		}
+		size_t begin = s * segment;
+		size_t end = (begin + segment < count) ? begin + segment : count;
 
-		for (char c : it->second)
+		BitWriter writer(dst);
+		for (size_t i = begin; i < end; i++)
 		{
-			bitbuf <<= 1;
-			if (c == '1') bitbuf |= 1;
-			bitcount++;
-			if (bitcount == 8)
-			{
-				dataBits.push_back(bitbuf);
-				bitbuf = 0;
-				bitcount = 0;
-			}
+			writer.Write(codes[symbols[i]], lengths[symbols[i]]);
 		}
-	}
-	if (bitcount > 0)
-	{
-		bitbuf <<= (8 - bitcount);
-		dataBits.push_back(bitbuf);
-	}
-
-	output.insert(
-		output.end(),
-		dataBits.begin(),
-		dataBits.end());
+		writer.Flush();
 
-	if (output.empty())
-	{
-		ForceClose(
-			"HuffmanEncode produced empty output for '" + origin + "'!\n",
-			ForceCloseType::TYPE_HUFFMAN_ENCODE);
+		dst += streamBytes[s];
+		if (writer.out != dst)
+		{
+			ForceClose(
+				"HuffmanEncode wrote an unexpected number of bytes for '" + origin + "'!\n",
+				ForceCloseType::TYPE_HUFFMAN_ENCODE);
 
-		return {};
+			return false;
+		}
 	}
 
-	return output;
+	return true;
 }
 
 vector<uint8_t> HuffmanDecode(
-	ifstream& in,
-	size_t storedSize,
+	const uint8_t* data,
+	size_t size,
 	const string& origin)
 {
-	vector<uint8_t> out{};
-
-	if (storedSize < 2)
+	if (size < 2)
 	{
 		ForceClose(
 			"Stored size is too small in '" + origin + "'!\n",
@@ -1150,31 +4774,75 @@ vector<uint8_t> HuffmanDecode(
 		return {};
 	}
 
+	size_t pos = 0;
+
 	//read storage mode flag
-	uint8_t mode{};
-	if (!in.read((char*)&mode, sizeof(uint8_t)))
+	uint8_t mode = data[pos++];
+
+	if (mode == HUFFMAN_MODE_CANONICAL
+		|| mode == HUFFMAN_MODE_INTERLEAVED)
+	{
+		return HuffmanDecodeCanonical(
+			data + pos,
+			size - pos,
+			mode == HUFFMAN_MODE_INTERLEAVED,
+			origin);
+	}
+	if (mode == HUFFMAN_MODE_BLOCKED)
+	{
+		return HuffmanDecodeBlocked(
+			data + pos,
+			size - pos,
+			origin);
+	}
+
+	BufferSource reader({ data + pos, size - pos });
+
+	size_t totalSymbols{};
+	unique_ptr<HuffNode> root = ReadHuffmanTree(reader, mode, totalSymbols, origin);
+	if (!root) return {};
+
+	//decode the remaining bitstream
+	vector<uint8_t> out{};
+	out.reserve(totalSymbols);
+
+	TreeSource symbols(reader, root.get(), totalSymbols);
+
+	uint8_t symbol{};
+	while (symbols.Take(symbol)) out.push_back(symbol);
+
+	if (out.size() != totalSymbols)
 	{
 		ForceClose(
-			"Unexpected EOF while reading Huffman storage mode in '" + origin + "'!\n",
+			"Output size mismatch in '" + origin + "'!\n",
 			ForceCloseType::TYPE_HUFFMAN_DECODE);
 
 		return {};
 	}
 
+	return out;
+}
+
+template <typename Reader>
+unique_ptr<HuffNode> ReadHuffmanTree(
+	Reader& reader,
+	uint8_t mode,
+	size_t& symbolCount,
+	const string& origin)
+{
 	size_t freq[256]{};
-	uint16_t nonZero = 0;
 
-	if (mode == 1)
+	if (mode == HUFFMAN_MODE_SPARSE)
 	{
 		//read nonZero count
-		
-		if (!in.read((char*)&nonZero, sizeof(uint16_t)))
+		uint16_t nonZero = 0;
+		if (!reader.Take(reinterpret_cast<uint8_t*>(&nonZero), sizeof(uint16_t)))
 		{
 			ForceClose(
 				"Unexpected EOF while reading Huffman table size in '" + origin + "'!\n",
 				ForceCloseType::TYPE_HUFFMAN_DECODE);
 
-			return {};
+			return nullptr;
 		}
 
 		//read each (symbol, freq)
@@ -1182,129 +4850,380 @@ vector<uint8_t> HuffmanDecode(
 		{
 			uint8_t symbol{};
 			uint32_t f{};
-			if (!in.read((char*)&symbol, sizeof(uint8_t))
-				|| !in.read((char*)&f, sizeof(uint32_t)))
+			if (!reader.Take(symbol)
+				|| !reader.Take(reinterpret_cast<uint8_t*>(&f), sizeof(uint32_t)))
 			{
 				ForceClose(
 					"Unexpected EOF while reading Huffman sparse table entry in '" + origin + "'!\n",
 					ForceCloseType::TYPE_HUFFMAN_DECODE);
 
-				return {};
+				return nullptr;
 			}
+
 			freq[symbol] = f;
 		}
 	}
 	else
 	{
 		//dense table
-		for (int i = 0; i < 256; i++)
+		uint32_t dense[256]{};
+		if (!reader.Take(reinterpret_cast<uint8_t*>(dense), sizeof(dense)))
 		{
-			uint32_t f{};
-			if (!in.read((char*)&f, sizeof(uint32_t)))
-			{
-				ForceClose(
-					"Unexpected EOF while reading Huffman dense table entry in '" + origin + "'!\n",
-					ForceCloseType::TYPE_HUFFMAN_DECODE);
+			ForceClose(
+				"Unexpected EOF while reading Huffman dense table entry in '" + origin + "'!\n",
+				ForceCloseType::TYPE_HUFFMAN_DECODE);
 
-				return {};
-			}
-			freq[i] = f;
+			return nullptr;
 		}
+
+		for (int i = 0; i < 256; i++) freq[i] = dense[i];
 	}
 
 	//rebuild tree
-	priority_queue<unique_ptr<HuffNode>, vector<unique_ptr<HuffNode>>, NodeCompare> pq{};
-	size_t totalSymbols{};
-	for (int i = 0; i < 256; i++)
+	symbolCount = 0;
+	for (int i = 0; i < 256; i++) symbolCount += freq[i];
+
+	unique_ptr<HuffNode> root = BuildTree(freq);
+	if (!root)
 	{
-		if (freq[i] > 0)
-		{
-			pq.push(make_unique<HuffNode>((uint8_t)i, freq[i]));
-			totalSymbols += freq[i];
-		}
+		ForceClose(
+			"Found empty frequency table in '" + origin + "'!\n",
+			ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+		return nullptr;
 	}
-	if (pq.empty())
+
+	//every symbol takes at least one bit, so a larger count cannot be genuine
+	if (symbolCount > reader.GetRemaining() * 8)
 	{
 		ForceClose(
-			"Found empty frequency table in '" + origin + "'!\n",
+			"Huffman symbol count is larger than the bitstream in '" + origin + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+		return nullptr;
+	}
+
+	return root;
+}
+
+vector<uint8_t> HuffmanDecodeCanonical(
+	const uint8_t* data,
+	size_t size,
+	bool interleaved,
+	const string& origin)
+{
+	size_t pos = 0;
+
+	uint64_t symbolCount{};
+	if (pos + sizeof(uint64_t) > size)
+	{
+		ForceClose(
+			"Unexpected EOF while reading Huffman header in '" + origin + "'!\n",
 			ForceCloseType::TYPE_HUFFMAN_DECODE);
 
 		return {};
 	}
-	if (pq.size() == 1) pq.push(make_unique<HuffNode>(0, 1));
+	memcpy(&symbolCount, data + pos, sizeof(uint64_t));
+	pos += sizeof(uint64_t);
 
-	while (pq.size() > 1)
+	//read 4-bit code lengths
+	uint8_t lengths[256]{};
+	if (!ReadCodeLengths(data, size, pos, lengths))
 	{
-		auto ExtractTop = [&](auto& q)
-			{
-				unique_ptr<HuffNode> node = move(const_cast<unique_ptr<HuffNode>&>(q.top()));
-				q.pop();
-				return node;
-			};
+		ForceClose(
+			"Unexpected EOF while reading Huffman code lengths in '" + origin + "'!\n",
+			ForceCloseType::TYPE_HUFFMAN_DECODE);
 
-		auto left = ExtractTop(pq);
-		auto right = ExtractTop(pq);
+		return {};
+	}
 
-		auto merged = make_unique<HuffNode>(move(left), move(right));
-		pq.push(move(merged));
+	HuffDecodeTable table{};
+	if (!BuildDecodeTable(lengths, table))
+	{
+		ForceClose(
+			"Invalid Huffman code lengths in '" + origin + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+		return {};
 	}
-	unique_ptr<HuffNode> root = move(const_cast<unique_ptr<HuffNode>&>(pq.top()));
-	pq.pop();
 
-	//read remaining bitstream
-	size_t headerBytes = 0;
-	if (mode == 1)
+	//every symbol takes at least one bit, so a larger count cannot be genuine
+	if (symbolCount > (size - pos) * 8)
 	{
-		//sparse
-		headerBytes = sizeof(uint8_t) + sizeof(uint16_t) + nonZero * (sizeof(uint8_t) + sizeof(uint32_t));
+		ForceClose(
+			"Huffman symbol count is larger than the bitstream in '" + origin + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+		return {};
 	}
-	else
+
+	vector<uint8_t> out(static_cast<size_t>(symbolCount));
+
+	if (!DecodeBitstreams(
+		data + pos,
+		size - pos,
+		table,
+		interleaved,
+		out.data(),
+		out.size(),
+		origin))
 	{
-		//dense
-		headerBytes = sizeof(uint8_t) + 256 * sizeof(uint32_t);
+		return {};
 	}
 
-	size_t remaining = storedSize - headerBytes;
+	return out;
+}
+
+vector<uint8_t> HuffmanDecodeBlocked(
+	const uint8_t* data,
+	size_t size,
+	const string& origin)
+{
+	size_t pos = 0;
+
+	uint64_t symbolCount{};
+	uint32_t blockSize{};
+	if (pos + sizeof(uint64_t) + sizeof(uint32_t) > size)
+	{
+		ForceClose(
+			"Unexpected EOF while reading Huffman header in '" + origin + "'!\n",
+			ForceCloseType::TYPE_HUFFMAN_DECODE);
 
-	vector<uint8_t> bitstream(remaining);
-	if (!in.read((char*)bitstream.data(), remaining))
+		return {};
+	}
+	memcpy(&symbolCount, data + pos, sizeof(uint64_t));
+	pos += sizeof(uint64_t);
+	memcpy(&blockSize, data + pos, sizeof(uint32_t));
+	pos += sizeof(uint32_t);
+
+	//every symbol takes at least one bit, so a larger count cannot be genuine
+	if (blockSize == 0
+		|| symbolCount > (size - pos) * 8)
 	{
 		ForceClose(
-			"Unexpected EOF while reading Huffman bitstream in '" + origin + "'!\n",
+			"Invalid Huffman block header in '" + origin + "' (corruption suspected)!\n",
 			ForceCloseType::TYPE_HUFFMAN_DECODE);
 
 		return {};
 	}
 
-	//decode
-	HuffNode* node = root.get();
-	for (size_t i = 0; i < bitstream.size(); i++)
+	vector<uint8_t> out(static_cast<size_t>(symbolCount));
+
+	HuffDecodeTable table{};
+	bool hasTable = false;
+
+	for (size_t begin = 0; begin < out.size(); begin += blockSize)
 	{
-		uint8_t byte = bitstream[i];
-		for (int b = 7; b >= 0; b--)
+		size_t count = (out.size() - begin < blockSize) ? out.size() - begin : blockSize;
+
+		if (pos >= size)
 		{
-			int bit = (byte >> b) & 1;
-			node = (bit == 0) ? node->left.get() : node->right.get();
+			ForceClose(
+				"Unexpected EOF while reading Huffman block in '" + origin + "'!\n",
+				ForceCloseType::TYPE_HUFFMAN_DECODE);
 
-			if (!node->left
-				&& !node->right)
+			return {};
+		}
+
+		uint8_t tableFlag = data[pos++];
+		if (tableFlag == BLOCK_NEW_TABLE)
+		{
+			uint8_t lengths[256]{};
+			if (!ReadCodeLengths(data, size, pos, lengths)
+				|| !BuildDecodeTable(lengths, table))
 			{
-				out.push_back(node->symbol);
-				node = root.get();
+				ForceClose(
+					"Invalid Huffman code lengths in '" + origin + "' (corruption suspected)!\n",
+					ForceCloseType::TYPE_HUFFMAN_DECODE);
 
-				if (out.size() == totalSymbols) return out;
+				return {};
 			}
+			hasTable = true;
+		}
+		else if (tableFlag != BLOCK_REPEAT_TABLE
+			|| !hasTable)
+		{
+			ForceClose(
+				"Invalid Huffman block table flag in '" + origin + "' (corruption suspected)!\n",
+				ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+			return {};
+		}
+
+		uint32_t blockBytes{};
+		if (pos + sizeof(uint32_t) > size)
+		{
+			ForceClose(
+				"Unexpected EOF while reading Huffman block in '" + origin + "'!\n",
+				ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+			return {};
+		}
+		memcpy(&blockBytes, data + pos, sizeof(uint32_t));
+		pos += sizeof(uint32_t);
+
+		if (blockBytes > size - pos)
+		{
+			ForceClose(
+				"Huffman block size points past the end of '" + origin + "' (corruption suspected)!\n",
+				ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+			return {};
+		}
+
+		if (!DecodeBitstreams(
+			data + pos,
+			blockBytes,
+			table,
+			count >= INTERLEAVE_MIN_SYMBOLS,
+			out.data() + begin,
+			count,
+			origin))
+		{
+			return {};
 		}
+		pos += blockBytes;
 	}
 
-	if (out.size() != totalSymbols)
+	if (pos != size)
 	{
 		ForceClose(
-			"Output size mismatch in '" + origin + "'!\n",
+			"Trailing data after the last Huffman block in '" + origin + "' (corruption suspected)!\n",
 			ForceCloseType::TYPE_HUFFMAN_DECODE);
 
 		return {};
 	}
 
 	return out;
-}
\ No newline at end of file
+}
+
+bool DecodeSymbol(
+	BitReader& reader,
+	const HuffDecodeTable& table,
+	uint8_t& symbol)
+{
+	uint16_t entry = table.entries[reader.Peek(table.bits)];
+	uint32_t length = entry >> 8;
+
+	symbol = (uint8_t)entry;
+	return length != 0
+		&& reader.Skip(length);
+}
+
+bool DecodeBitstreams(
+	const uint8_t* data,
+	size_t size,
+	const HuffDecodeTable& table,
+	bool interleaved,
+	uint8_t* out,
+	size_t count,
+	const string& origin)
+{
+	size_t pos = 0;
+
+	//read the jump table and split the rest into bitstreams
+	size_t streamCount = interleaved ? HUFFMAN_STREAMS : 1;
+	size_t streamBytes[HUFFMAN_STREAMS]{};
+
+	if (interleaved)
+	{
+		if (pos + (HUFFMAN_STREAMS - 1) * sizeof(uint32_t) > size)
+		{
+			ForceClose(
+				"Unexpected EOF while reading Huffman jump table in '" + origin + "'!\n",
+				ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+			return false;
+		}
+
+		size_t total = 0;
+		for (size_t s = 0; s < HUFFMAN_STREAMS - 1; s++)
+		{
+			uint32_t streamSize{};
+			memcpy(&streamSize, data + pos, sizeof(uint32_t));
+			pos += sizeof(uint32_t);
+
+			streamBytes[s] = streamSize;
+			total += streamSize;
+		}
+
+		if (total > size - pos)
+		{
+			ForceClose(
+				"Huffman jump table points past the end of '" + origin + "' (corruption suspected)!\n",
+				ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+			return false;
+		}
+		streamBytes[HUFFMAN_STREAMS - 1] = size - pos - total;
+	}
+	else streamBytes[0] = size - pos;
+
+	size_t segment = (count + streamCount - 1) / streamCount;
+	if (segment * (streamCount - 1) > count)
+	{
+		ForceClose(
+			"Too few Huffman symbols for interleaved streams in '" + origin + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+		return false;
+	}
+
+	BitReader readers[HUFFMAN_STREAMS]{};
+	uint8_t* dst[HUFFMAN_STREAMS]{};
+	for (size_t s = 0; s < streamCount; s++)
+	{
+		readers[s] = BitReader(data + pos, streamBytes[s]);
+		dst[s] = out + s * segment;
+		pos += streamBytes[s];
+	}
+
+	//every stream but the last holds exactly segment symbols, the last one holds the rest
+	size_t lastSegment = count - segment * (streamCount - 1);
+
+	//each refill leaves at least 56 bits, enough for this many codes per stream
+	size_t perRefill = 56 / table.bits;
+
+	size_t done = 0;
+	bool valid = true;
+
+	//the streams are independent, so decoding them in lockstep keeps
+	//several lookups in flight instead of one long dependency chain
+	while (done + perRefill <= lastSegment
+		&& valid)
+	{
+		for (size_t s = 0; s < streamCount; s++) readers[s].Refill();
+
+		for (size_t j = 0; j < perRefill; j++)
+		{
+			for (size_t s = 0; s < streamCount; s++)
+			{
+				valid &= DecodeSymbol(readers[s], table, dst[s][done + j]);
+			}
+		}
+		done += perRefill;
+	}
+
+	//finish each stream on its own
+	for (size_t s = 0; s < streamCount && valid; s++)
+	{
+		size_t segmentCount = (s == streamCount - 1) ? lastSegment : segment;
+
+		for (size_t i = done; i < segmentCount && valid; i++)
+		{
+			readers[s].Refill();
+			valid &= DecodeSymbol(readers[s], table, dst[s][i]);
+		}
+	}
+
+	if (!valid)
+	{
+		ForceClose(
+			"Invalid Huffman code in '" + origin + "' (corruption suspected)!\n",
+			ForceCloseType::TYPE_HUFFMAN_DECODE);
+
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,628 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define KALADATA_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#include <fstream>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+
+#include "fileio.hpp"
+
+using KalaData::FileIO;
+using KalaData::FileRequest;
+using KalaData::FileIOStats;
+
+using std::string;
+using std::vector;
+using std::filesystem::path;
+using std::fstream;
+using std::ios;
+using std::streamoff;
+using std::streamsize;
+using std::atomic;
+using std::atomic_ref;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::unique_ptr;
+using std::make_unique;
+using std::move;
+using std::initializer_list;
+using std::unordered_map;
+using std::min;
+using std::max;
+using std::memset;
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+
+//Largest single read or write, the kernel moves a bit under 2GB per call at most
+constexpr uint64_t TRANSFER_LIMIT = uint64_t(1) << 30;
+
+//One file of a batch and the requests on it
+struct BatchFile
+{
+	const path* file;
+	bool create;
+	vector<size_t> requests;
+	int fd;
+	steady_clock::time_point opened;
+};
+
+static atomic<uint64_t> syscallCount = 0;
+static atomic<uint64_t> fileCount = 0;
+static atomic<uint64_t> latencyTotalNs = 0;
+static atomic<uint64_t> latencyMaxNs = 0;
+static atomic<bool> usedRing = false;
+static atomic<bool> usedStreams = false;
+
+static void RunBatch(
+	vector<FileRequest>& requests,
+	bool write);
+
+//Group the requests by file, in the order the files first appear
+static vector<BatchFile> GroupByFile(vector<FileRequest>& requests);
+
+//Open, transfer and close every file of the batch through iostreams, one file after another
+static void RunStreams(
+	vector<FileRequest>& requests,
+	vector<BatchFile>& files,
+	bool write);
+
+static void RecordFile(steady_clock::time_point opened);
+
+#ifdef KALADATA_URING
+//How many operations one thread keeps in flight on its ring at once
+constexpr unsigned RING_ENTRIES = 64;
+
+//Submission and completion queues shared with the kernel, set up with raw system calls
+//so no library is needed. Every thread that runs batches gets a ring of its own
+class Ring
+{
+public:
+	~Ring()
+	{
+		if (sqes != nullptr) munmap(sqes, sqeSize);
+		if (cqRing != nullptr && cqRing != sqRing) munmap(cqRing, cqRingSize);
+		if (sqRing != nullptr) munmap(sqRing, sqRingSize);
+		if (fd >= 0) close(fd);
+	}
+
+	//Returns false if io_uring or one of the operations the batches use is not available
+	bool Open()
+	{
+		io_uring_params params{};
+		fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+		syscallCount++;
+		if (fd < 0) return false;
+
+		if (!Supports({ IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE })) return false;
+
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		//newer kernels map both rings with one call
+		bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+
+		sqRing = Map(sqRingSize, IORING_OFF_SQ_RING);
+		if (sqRing == nullptr) return false;
+
+		cqRing = single ? sqRing : Map(cqRingSize, IORING_OFF_CQ_RING);
+		if (cqRing == nullptr) return false;
+
+		sqeSize = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe*)Map(sqeSize, IORING_OFF_SQES);
+		if (sqes == nullptr) return false;
+
+		uint8_t* sq = (uint8_t*)sqRing;
+		sqTail = (uint32_t*)(sq + params.sq_off.tail);
+		sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+		sqArray = (uint32_t*)(sq + params.sq_off.array);
+
+		uint8_t* cq = (uint8_t*)cqRing;
+		cqHead = (uint32_t*)(cq + params.cq_off.head);
+		cqTail = (uint32_t*)(cq + params.cq_off.tail);
+		cqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+		capacity = params.sq_entries;
+		localTail = *sqTail;
+
+		return true;
+	}
+
+	unsigned GetCapacity() const { return capacity; }
+
+	//Next free submission entry, cleared. The kernel sees it after the next Submit
+	io_uring_sqe& NextEntry()
+	{
+		uint32_t index = localTail & sqMask;
+		sqArray[index] = index;
+
+		io_uring_sqe& entry = sqes[index];
+		memset(&entry, 0, sizeof(io_uring_sqe));
+
+		localTail++;
+		unsubmitted++;
+		return entry;
+	}
+
+	//Hands every new entry to the kernel and waits until wait operations are complete,
+	//returns false if the ring can no longer be used
+	bool Submit(unsigned wait)
+	{
+		atomic_ref<uint32_t>(*sqTail).store(localTail, memory_order_release);
+
+		do
+		{
+			//the kernel returns without waiting when it takes fewer entries than it was given,
+			//so the wait only starts once every operation waited for is really in flight
+			long result = syscall(
+				__NR_io_uring_enter,
+				fd,
+				unsubmitted,
+				wait,
+				IORING_ENTER_GETEVENTS,
+				nullptr,
+				0);
+			syscallCount++;
+
+			if (result < 0 && errno == EINTR) continue;
+			if (result < 0) return false;
+
+			//a call that takes nothing would only be repeated forever
+			if (result == 0 && unsubmitted > 0) return false;
+
+			unsubmitted -= (unsigned)result;
+		} while (unsubmitted > 0);
+
+		return true;
+	}
+
+	//Calls Handle(userData, result) for every finished operation
+	template <typename Handle>
+	void Reap(Handle handle)
+	{
+		uint32_t head = *cqHead;
+		uint32_t tail = atomic_ref<uint32_t>(*cqTail).load(memory_order_acquire);
+
+		for (; head != tail; head++)
+		{
+			const io_uring_cqe& completion = cqes[head & cqMask];
+			handle(completion.user_data, completion.res);
+		}
+		atomic_ref<uint32_t>(*cqHead).store(head, memory_order_release);
+	}
+private:
+	int fd = -1;
+	unsigned capacity{};
+
+	void* sqRing{};
+	size_t sqRingSize{};
+	void* cqRing{};
+	size_t cqRingSize{};
+	io_uring_sqe* sqes{};
+	size_t sqeSize{};
+
+	uint32_t* sqTail{};
+	uint32_t sqMask{};
+	uint32_t* sqArray{};
+	uint32_t localTail{};
+	unsigned unsubmitted{};
+
+	uint32_t* cqHead{};
+	uint32_t* cqTail{};
+	uint32_t cqMask{};
+	io_uring_cqe* cqes{};
+
+	void* Map(
+		size_t size,
+		uint64_t offset)
+	{
+		void* address = mmap(
+			nullptr,
+			size,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,
+			fd,
+			(off_t)offset);
+		syscallCount++;
+
+		return address == MAP_FAILED ? nullptr : address;
+	}
+
+	bool Supports(initializer_list<uint8_t> ops)
+	{
+		vector<uint8_t> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+		io_uring_probe* probe = (io_uring_probe*)buffer.data();
+
+		long result = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256);
+		syscallCount++;
+		if (result < 0) return false;
+
+		for (uint8_t op : ops)
+		{
+			if (op > probe->last_op
+				|| (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+//Set once a thread found out io_uring is not there, so other threads do not ask again
+static atomic<bool> ringUnavailable = false;
+
+static thread_local unique_ptr<Ring> threadRing{};
+static thread_local bool threadRingTried = false;
+
+//Returns the ring of this thread, or nullptr if batches have to use iostreams
+static Ring* GetRing();
+
+//Runs a batch on the ring of this thread, returns false if the ring broke down.
+//Every file is closed again either way
+static bool RunRing(
+	Ring& ring,
+	vector<FileRequest>& requests,
+	vector<BatchFile>& files,
+	bool write);
+
+//Keeps up to a ring full of operations in flight until all count of them are done.
+//Prepare(i, entry) fills the entry of operation i, Complete(i, result) takes its result
+//and returns true if operation i has to run again
+template <typename Prepare, typename Complete>
+static bool RunOps(
+	Ring& ring,
+	size_t count,
+	Prepare prepare,
+	Complete complete)
+{
+	vector<size_t> queue(count);
+	for (size_t i = 0; i < count; i++) queue[i] = i;
+
+	size_t next = 0;
+	unsigned inFlight = 0;
+	while (next < queue.size()
+		|| inFlight > 0)
+	{
+		while (next < queue.size()
+			&& inFlight < ring.GetCapacity())
+		{
+			io_uring_sqe& entry = ring.NextEntry();
+			prepare(queue[next], entry);
+			entry.user_data = queue[next];
+
+			next++;
+			inFlight++;
+		}
+
+		//the batch has nothing else to do meanwhile, so one call waits for everything in flight.
+		//Operations that finished before the ring failed are still taken in,
+		//so the caller can close the files they opened
+		bool alive = ring.Submit(inFlight);
+
+		ring.Reap([&](uint64_t i, int32_t result)
+			{
+				inFlight--;
+				if (complete((size_t)i, result)) queue.push_back((size_t)i);
+			});
+
+		if (!alive) return false;
+	}
+	return true;
+}
+#endif
+
+namespace KalaData
+{
+	void FileIO::ReadBatch(vector<FileRequest>& requests)
+	{
+		RunBatch(requests, false);
+	}
+
+	void FileIO::WriteBatch(vector<FileRequest>& requests)
+	{
+		RunBatch(requests, true);
+	}
+
+	string FileIO::GetBackendName()
+	{
+		if (usedRing && usedStreams) return "io_uring and iostream";
+		if (usedRing) return "io_uring";
+		if (usedStreams) return "iostream";
+		return "none";
+	}
+
+	FileIOStats FileIO::GetStats()
+	{
+		return
+		{
+			syscallCount.load(),
+			fileCount.load(),
+			(double)latencyTotalNs.load() / 1e9,
+			(double)latencyMaxNs.load() / 1e9,
+			usedStreams.load()
+		};
+	}
+
+	void FileIO::ResetStats()
+	{
+		syscallCount = 0;
+		fileCount = 0;
+		latencyTotalNs = 0;
+		latencyMaxNs = 0;
+		usedRing = false;
+		usedStreams = false;
+	}
+}
+
+void RunBatch(
+	vector<FileRequest>& requests,
+	bool write)
+{
+	for (auto& request : requests)
+	{
+		request.transferred = 0;
+		request.ok = false;
+	}
+
+	vector<BatchFile> files = GroupByFile(requests);
+
+#ifdef KALADATA_URING
+	Ring* ring = GetRing();
+	if (ring != nullptr)
+	{
+		if (RunRing(*ring, requests, files, write))
+		{
+			usedRing = true;
+			return;
+		}
+
+		//a ring that failed once is not trusted again on this thread,
+		//the batch starts over on iostreams
+		threadRing.reset();
+		for (auto& request : requests)
+		{
+			request.transferred = 0;
+			request.ok = false;
+		}
+	}
+#endif
+
+	usedStreams = true;
+	RunStreams(requests, files, write);
+}
+
+vector<BatchFile> GroupByFile(vector<FileRequest>& requests)
+{
+	vector<BatchFile> files{};
+	unordered_map<string, size_t> index{};
+
+	for (size_t i = 0; i < requests.size(); i++)
+	{
+		auto [it, added] = index.emplace(requests[i].file.string(), files.size());
+		if (added) files.push_back({ &requests[i].file, false, {}, -1, {} });
+
+		BatchFile& file = files[it->second];
+		file.requests.push_back(i);
+		file.create = file.create || requests[i].create;
+	}
+	return files;
+}
+
+void RunStreams(
+	vector<FileRequest>& requests,
+	vector<BatchFile>& files,
+	bool write)
+{
+	for (auto& file : files)
+	{
+		auto opened = steady_clock::now();
+
+		ios::openmode mode = ios::binary;
+		if (!write) mode |= ios::in;
+		else if (file.create) mode |= ios::out | ios::trunc;
+		else mode |= ios::in | ios::out;
+
+		fstream stream(*file.file, mode);
+		syscallCount++;
+		if (!stream.is_open()) continue;
+
+		for (size_t i : file.requests)
+		{
+			FileRequest& request = requests[i];
+
+			if (!write)
+			{
+				stream.seekg(static_cast<streamoff>(request.offset));
+				stream.read((char*)request.data, static_cast<streamsize>(request.size));
+
+				request.transferred = static_cast<uint64_t>(stream.gcount());
+				request.ok = !stream.bad();
+			}
+			else
+			{
+				stream.seekp(static_cast<streamoff>(request.offset));
+				stream.write((const char*)request.data, static_cast<streamsize>(request.size));
+
+				request.ok = stream.good();
+				request.transferred = request.ok ? request.size : 0;
+			}
+			syscallCount += 2;
+
+			//a read past the end only ends this request
+			stream.clear();
+		}
+
+		//buffered bytes only reach the file on close, so a write can still fail here
+		stream.close();
+		syscallCount++;
+		if (stream.fail())
+		{
+			for (size_t i : file.requests) requests[i].ok = false;
+		}
+
+		RecordFile(opened);
+	}
+}
+
+void RecordFile(steady_clock::time_point opened)
+{
+	uint64_t elapsed = (uint64_t)duration_cast<nanoseconds>(steady_clock::now() - opened).count();
+
+	fileCount++;
+	latencyTotalNs += elapsed;
+
+	uint64_t highest = latencyMaxNs.load();
+	while (elapsed > highest
+		&& !latencyMaxNs.compare_exchange_weak(highest, elapsed)) {}
+}
+
+#ifdef KALADATA_URING
+Ring* GetRing()
+{
+	if (!threadRingTried)
+	{
+		threadRingTried = true;
+
+		if (!ringUnavailable)
+		{
+			auto ring = make_unique<Ring>();
+			if (ring->Open()) threadRing = move(ring);
+			else ringUnavailable = true;
+		}
+	}
+	return threadRing.get();
+}
+
+bool RunRing(
+	Ring& ring,
+	vector<FileRequest>& requests,
+	vector<BatchFile>& files,
+	bool write)
+{
+	int openFlags = O_CLOEXEC | (write ? O_WRONLY : O_RDONLY);
+
+	auto PrepareOpen = [&](size_t i, io_uring_sqe& entry)
+		{
+			entry.opcode = IORING_OP_OPENAT;
+			entry.fd = AT_FDCWD;
+			entry.addr = (uint64_t)files[i].file->c_str();
+			entry.open_flags = (uint32_t)(openFlags | (files[i].create ? O_CREAT | O_TRUNC : 0));
+			entry.len = 0666;
+
+			files[i].opened = steady_clock::now();
+		};
+	auto CompleteOpen = [&](size_t i, int32_t result)
+		{
+			files[i].fd = result;
+			return false;
+		};
+
+	bool alive = RunOps(ring, files.size(), PrepareOpen, CompleteOpen);
+
+	//empty requests are done once their file is open, the rest move their bytes
+	//in pieces of at most TRANSFER_LIMIT, short transfers continue where they stopped
+	vector<size_t> transfers{};
+	vector<int> transferFd{};
+	for (auto& file : files)
+	{
+		if (file.fd < 0) continue;
+
+		for (size_t i : file.requests)
+		{
+			if (requests[i].size == 0) requests[i].ok = true;
+			else
+			{
+				transfers.push_back(i);
+				transferFd.push_back(file.fd);
+			}
+		}
+	}
+
+	auto PrepareTransfer = [&](size_t i, io_uring_sqe& entry)
+		{
+			FileRequest& request = requests[transfers[i]];
+
+			entry.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+			entry.fd = transferFd[i];
+			entry.addr = (uint64_t)(request.data + request.transferred);
+			entry.len = (uint32_t)min(request.size - request.transferred, TRANSFER_LIMIT);
+			entry.off = request.offset + request.transferred;
+		};
+	auto CompleteTransfer = [&](size_t i, int32_t result)
+		{
+			FileRequest& request = requests[transfers[i]];
+
+			//a read that returns nothing reached the end of the file,
+			//a write that moves nothing would never finish
+			if (result <= 0)
+			{
+				request.ok = result == 0 && !write;
+				return false;
+			}
+
+			request.transferred += (uint64_t)result;
+			if (request.transferred < request.size) return true;
+
+			request.ok = true;
+			return false;
+		};
+
+	if (alive) alive = RunOps(ring, transfers.size(), PrepareTransfer, CompleteTransfer);
+
+	vector<size_t> opened{};
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (files[i].fd >= 0) opened.push_back(i);
+	}
+
+	auto PrepareClose = [&](size_t i, io_uring_sqe& entry)
+		{
+			entry.opcode = IORING_OP_CLOSE;
+			entry.fd = files[opened[i]].fd;
+		};
+	auto CompleteClose = [&](size_t i, int32_t result)
+		{
+			BatchFile& file = files[opened[i]];
+			file.fd = -1;
+
+			//some file systems only report failed writes on close
+			if (result < 0 && write)
+			{
+				for (size_t r : file.requests) requests[r].ok = false;
+			}
+			RecordFile(file.opened);
+			return false;
+		};
+
+	if (alive) alive = RunOps(ring, opened.size(), PrepareClose, CompleteClose);
+
+	if (!alive)
+	{
+		for (size_t i : opened)
+		{
+			if (files[i].fd >= 0) close(files[i].fd);
+			files[i].fd = -1;
+		}
+	}
+	return alive;
+}
+#endif
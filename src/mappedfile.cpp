@@ -0,0 +1,386 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+#include <atomic>
+#include <mutex>
+
+#include "mappedfile.hpp"
+
+using KalaData::MappedFile;
+using KalaData::MappedFileStats;
+
+using std::filesystem::path;
+using std::atomic;
+using std::once_flag;
+using std::call_once;
+using std::memory_order_acquire;
+using std::memory_order_release;
+#ifdef _WIN32
+using std::mutex;
+using std::lock_guard;
+#endif
+
+//How many views can be open at once, a view that finds no free slot is not made
+//and its file is read the usual way instead
+constexpr size_t MAPPING_SLOTS = 1024;
+
+//One open view as the fault handler sees it, begin is 0 while the slot is free or being set up
+struct MappingSlot
+{
+	atomic<bool> used;
+	atomic<uintptr_t> begin;
+	atomic<uintptr_t> end;
+	atomic<bool> faulted;
+
+	//windows only: the view was swapped for zeroed memory
+	atomic<bool> replaced;
+};
+
+static MappingSlot mappingSlots[MAPPING_SLOTS]{};
+
+static atomic<uint64_t> syscallCount = 0;
+static atomic<uint64_t> viewCount = 0;
+
+static void InstallFaultHandler();
+
+//Returns the slot of the view that holds address, nullptr if it is in none of them
+static MappingSlot* FindSlot(uintptr_t address);
+
+#ifdef _WIN32
+//a view is swapped by one faulting thread at a time
+static mutex replaceLock{};
+
+static LONG CALLBACK OnPageError(EXCEPTION_POINTERS* exception);
+#else
+//looked up once, the fault handler can not ask for it safely
+static size_t pageSize{};
+
+static void OnBusError(
+	int number,
+	siginfo_t* info,
+	void* context);
+#endif
+
+namespace KalaData
+{
+	bool MappedFile::Open(
+		const path& file,
+		uint64_t offset,
+		uint64_t length)
+	{
+		Close();
+
+		if (length == 0) return false;
+
+		static once_flag installed{};
+		call_once(installed, InstallFaultHandler);
+
+		//a view is only made if the fault handler can find it
+		size_t free = MAPPING_SLOTS;
+		for (size_t i = 0; i < MAPPING_SLOTS && free == MAPPING_SLOTS; i++)
+		{
+			bool expected = false;
+			if (mappingSlots[i].used.compare_exchange_strong(expected, true)) free = i;
+		}
+		if (free == MAPPING_SLOTS) return false;
+
+		auto ReleaseSlot = [free]()
+			{
+				mappingSlots[free].used.store(false, memory_order_release);
+			};
+
+#ifdef _WIN32
+		HANDLE handle = CreateFileW(
+			file.c_str(),
+			GENERIC_READ,
+			FILE_SHARE_READ,
+			nullptr,
+			OPEN_EXISTING,
+			FILE_FLAG_SEQUENTIAL_SCAN,
+			nullptr);
+		syscallCount++;
+
+		if (handle == INVALID_HANDLE_VALUE)
+		{
+			ReleaseSlot();
+			return false;
+		}
+
+		LARGE_INTEGER fileSize{};
+		bool isDisk = GetFileType(handle) == FILE_TYPE_DISK;
+		syscallCount++;
+
+		bool hasSize = isDisk && GetFileSizeEx(handle, &fileSize);
+		if (isDisk) syscallCount++;
+
+		if (!hasSize
+			|| static_cast<uint64_t>(fileSize.QuadPart) < offset + length)
+		{
+			CloseHandle(handle);
+			syscallCount++;
+			ReleaseSlot();
+			return false;
+		}
+
+		HANDLE mapping = CreateFileMappingW(
+			handle,
+			nullptr,
+			PAGE_READONLY,
+			0,
+			0,
+			nullptr);
+
+		CloseHandle(handle);
+		syscallCount += 2;
+		if (mapping == nullptr)
+		{
+			ReleaseSlot();
+			return false;
+		}
+
+		//views start on allocation boundaries, file mappings can not use large pages
+		SYSTEM_INFO info{};
+		GetSystemInfo(&info);
+
+		uint64_t start = offset - offset % info.dwAllocationGranularity;
+		size_t lead = static_cast<size_t>(offset - start);
+
+		void* mapped = MapViewOfFile(
+			mapping,
+			FILE_MAP_READ,
+			static_cast<DWORD>(start >> 32),
+			static_cast<DWORD>(start),
+			static_cast<SIZE_T>(length + lead));
+
+		//the view keeps the mapping alive on its own
+		CloseHandle(mapping);
+		syscallCount += 2;
+		if (mapped == nullptr)
+		{
+			ReleaseSlot();
+			return false;
+		}
+#else
+		int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+		syscallCount++;
+		if (fd < 0)
+		{
+			ReleaseSlot();
+			return false;
+		}
+
+		struct stat info{};
+		if (fstat(fd, &info) != 0
+			|| !S_ISREG(info.st_mode)
+			|| static_cast<uint64_t>(info.st_size) < offset + length)
+		{
+			close(fd);
+			syscallCount += 2;
+			ReleaseSlot();
+			return false;
+		}
+
+		uint64_t start = offset - offset % pageSize;
+		size_t lead = static_cast<size_t>(offset - start);
+
+		void* mapped = mmap(
+			nullptr,
+			static_cast<size_t>(length + lead),
+			PROT_READ,
+			MAP_PRIVATE,
+			fd,
+			static_cast<off_t>(start));
+
+		//the mapping keeps the file open on its own
+		close(fd);
+		syscallCount += 3;
+		if (mapped == MAP_FAILED)
+		{
+			ReleaseSlot();
+			return false;
+		}
+
+		//read ahead aggressively and start reading now, so the pages are mostly in by the time
+		//the compressor gets to them. Huge pages are only a hint, most file systems ignore it
+#ifdef MADV_HUGEPAGE
+		madvise(mapped, static_cast<size_t>(length + lead), MADV_HUGEPAGE);
+		syscallCount++;
+#endif
+		madvise(mapped, static_cast<size_t>(length + lead), MADV_SEQUENTIAL);
+		madvise(mapped, static_cast<size_t>(length + lead), MADV_WILLNEED);
+		syscallCount += 2;
+#endif
+		viewCount++;
+
+		view = mapped;
+		viewSize = static_cast<size_t>(length + lead);
+		data = static_cast<const uint8_t*>(mapped) + lead;
+		size = static_cast<size_t>(length);
+		slot = free;
+
+		MappingSlot& entry = mappingSlots[slot];
+		entry.faulted.store(false);
+		entry.replaced.store(false);
+		entry.end.store(reinterpret_cast<uintptr_t>(view) + viewSize);
+		entry.begin.store(reinterpret_cast<uintptr_t>(view), memory_order_release);
+
+		return true;
+	}
+
+	void MappedFile::Close()
+	{
+		if (view == nullptr) return;
+
+		//the handler stops looking at the view before it goes away
+		MappingSlot& entry = mappingSlots[slot];
+		entry.begin.store(0, memory_order_release);
+
+#ifdef _WIN32
+		if (entry.replaced.load()) VirtualFree(view, 0, MEM_RELEASE);
+		else UnmapViewOfFile(view);
+#else
+		munmap(view, viewSize);
+#endif
+		syscallCount++;
+
+		entry.end.store(0);
+		entry.used.store(false, memory_order_release);
+
+		view = nullptr;
+		viewSize = 0;
+		data = nullptr;
+		size = 0;
+	}
+
+	bool MappedFile::IsFaulted() const
+	{
+		return view != nullptr
+			&& mappingSlots[slot].faulted.load(memory_order_acquire);
+	}
+
+	MappedFileStats MappedFile::GetStats()
+	{
+		return
+		{
+			syscallCount.load(),
+			viewCount.load()
+		};
+	}
+
+	void MappedFile::ResetStats()
+	{
+		syscallCount = 0;
+		viewCount = 0;
+	}
+}
+
+MappingSlot* FindSlot(uintptr_t address)
+{
+	for (size_t i = 0; i < MAPPING_SLOTS; i++)
+	{
+		uintptr_t begin = mappingSlots[i].begin.load(memory_order_acquire);
+		if (begin == 0
+			|| address < begin)
+		{
+			continue;
+		}
+
+		if (address < mappingSlots[i].end.load()) return &mappingSlots[i];
+	}
+	return nullptr;
+}
+
+#ifdef _WIN32
+void InstallFaultHandler()
+{
+	AddVectoredExceptionHandler(1, OnPageError);
+}
+
+LONG CALLBACK OnPageError(EXCEPTION_POINTERS* exception)
+{
+	const EXCEPTION_RECORD* record = exception->ExceptionRecord;
+	if (record->ExceptionCode != EXCEPTION_IN_PAGE_ERROR
+		|| record->NumberParameters < 2)
+	{
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	MappingSlot* entry = FindSlot(static_cast<uintptr_t>(record->ExceptionInformation[1]));
+	if (entry == nullptr) return EXCEPTION_CONTINUE_SEARCH;
+
+	//a view can not be unmapped in part, so all of it is swapped for zeroed memory at the same address
+	lock_guard<mutex> lock(replaceLock);
+	if (!entry->replaced.load())
+	{
+		void* base = reinterpret_cast<void*>(entry->begin.load());
+		SIZE_T length = static_cast<SIZE_T>(entry->end.load() - entry->begin.load());
+
+		UnmapViewOfFile(base);
+		void* zeros = VirtualAlloc(base, length, MEM_RESERVE | MEM_COMMIT, PAGE_READONLY);
+		syscallCount += 2;
+
+		if (zeros != base) return EXCEPTION_CONTINUE_SEARCH;
+		entry->replaced.store(true);
+	}
+	entry->faulted.store(true, memory_order_release);
+
+	//the faulting read runs again and sees zeros
+	return EXCEPTION_CONTINUE_EXECUTION;
+}
+#else
+void InstallFaultHandler()
+{
+	pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+	struct sigaction action{};
+	action.sa_sigaction = OnBusError;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+
+	sigaction(SIGBUS, &action, nullptr);
+}
+
+void OnBusError(
+	int number,
+	siginfo_t* info,
+	void* context)
+{
+	uintptr_t address = reinterpret_cast<uintptr_t>(info->si_addr);
+
+	//the view from the missing page on is replaced by zeros, the faulting read runs again and sees them
+	MappingSlot* entry = FindSlot(address);
+	if (entry != nullptr)
+	{
+		uintptr_t page = address - address % pageSize;
+		void* zeros = mmap(
+			reinterpret_cast<void*>(page),
+			static_cast<size_t>(entry->end.load() - page),
+			PROT_READ,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+			-1,
+			0);
+		syscallCount++;
+
+		if (zeros != MAP_FAILED)
+		{
+			entry->faulted.store(true, memory_order_release);
+			return;
+		}
+	}
+
+	//faults outside of any view are not ours, with the default action back in place
+	//the faulting access runs again and ends the process as it would have without us
+	signal(number, SIG_DFL);
+}
+#endif
@@ -0,0 +1,316 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#include <vector>
+#include <cmath>
+
+#include "rangecoder.hpp"
+
+using KalaData::RangeEncoder;
+using KalaData::RangeDecoder;
+using KalaData::LiteralModel;
+
+using std::vector;
+using std::exp;
+using std::log;
+
+//Stretched chances lie in -STRETCH_LIMIT to STRETCH_LIMIT, 256 steps per unit of ln(p / (1 - p))
+constexpr int32_t STRETCH_LIMIT = 2047;
+
+//Mixer weights are fixed point with 16 fractional bits
+constexpr int32_t WEIGHT_ONE = 65536;
+
+//How fast the mixer weights follow the coding error
+constexpr int32_t MIXER_RATE = 4;
+
+//Counters start at an even chance with no updates
+constexpr uint32_t COUNTER_START = 0x80000000;
+
+//How many past bits the counters of each literal context average over at most,
+//sparse contexts have to keep up with change, dense ones can afford to settle
+constexpr uint32_t COUNT_LIMIT_ORDER0 = 255;
+constexpr uint32_t COUNT_LIMIT_ORDER1 = 60;
+constexpr uint32_t COUNT_LIMIT_ORDER2 = 12;
+constexpr uint32_t COUNT_LIMIT_EXPECT = 60;
+
+static vector<int16_t> BuildStretchTable();
+
+static vector<int16_t> BuildSquashTable();
+
+//12-bit chance to its stretched value
+static const vector<int16_t> stretchTable = BuildStretchTable();
+
+//Stretched value offset by STRETCH_LIMIT back to a 12-bit chance
+static const vector<int16_t> squashTable = BuildSquashTable();
+
+static vector<int32_t> BuildReciprocalTable();
+
+//Step size of a counter after n updates, 2 / (2n + 3) with 16 fractional bits
+static const vector<int32_t> reciprocalTable = BuildReciprocalTable();
+
+static uint32_t NibbleIndex(
+	uint32_t node,
+	size_t bitIndex);
+
+static int32_t Stretch(uint32_t chance);
+
+static uint32_t Squash(int32_t value);
+
+static void UpdateCounter(
+	uint32_t& counter,
+	uint32_t bit,
+	uint32_t limit);
+
+namespace KalaData
+{
+	void RangeEncoder::Flush()
+	{
+		//any value in the range decodes the same, low is as good as any
+		for (int i = 0; i < 4; i++)
+		{
+			out.push_back((uint8_t)(low >> 24));
+			low <<= 8;
+		}
+	}
+
+	RangeDecoder::RangeDecoder(
+		const uint8_t* src,
+		size_t size) :
+		data(src),
+		end(src + size)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			code = (code << 8) | NextByte();
+		}
+	}
+
+	LiteralModel::LiteralModel(uint8_t tableBits) :
+		order0(256, COUNTER_START),
+		order1(256 * 256, COUNTER_START),
+		order2(size_t(1) << tableBits, COUNTER_START),
+		expect(2 * 256 * 256, COUNTER_START),
+		order2Bits(tableBits),
+		weights(2 * 2 * 8 * INPUTS, 0)
+	{
+		//start out trusting every input a bit, the bias input starts unused
+		for (size_t i = 0; i < weights.size(); i += INPUTS)
+		{
+			for (size_t j = 0; j < INPUTS - 1; j++) weights[i + j] = WEIGHT_ONE * 3 / 10;
+		}
+	}
+
+	void LiteralModel::Encode(
+		RangeEncoder& encoder,
+		uint8_t literal,
+		uint8_t prev1,
+		uint8_t prev2,
+		uint8_t expected,
+		bool afterMatch)
+	{
+		Context context = Select(prev1, prev2, expected, afterMatch);
+
+		uint32_t node = 1;
+		for (size_t i = 0; i < 8; i++)
+		{
+			int32_t st[INPUTS]{};
+			uint32_t* slots[INPUTS - 1]{};
+			int32_t* w{};
+			uint32_t chance = Predict(context, i, node, st, slots, w);
+
+			uint32_t bit = (literal >> (7 - i)) & 1;
+			encoder.Encode(bit, chance);
+
+			Update(st, slots, w, chance, bit);
+			node = (node << 1) | bit;
+		}
+	}
+
+	uint8_t LiteralModel::Decode(
+		RangeDecoder& decoder,
+		uint8_t prev1,
+		uint8_t prev2,
+		uint8_t expected,
+		bool afterMatch)
+	{
+		Context context = Select(prev1, prev2, expected, afterMatch);
+
+		uint32_t node = 1;
+		for (size_t i = 0; i < 8; i++)
+		{
+			int32_t st[INPUTS]{};
+			uint32_t* slots[INPUTS - 1]{};
+			int32_t* w{};
+			uint32_t chance = Predict(context, i, node, st, slots, w);
+
+			uint32_t bit = decoder.Decode(chance);
+
+			Update(st, slots, w, chance, bit);
+			node = (node << 1) | bit;
+		}
+		return (uint8_t)node;
+	}
+
+	LiteralModel::Context LiteralModel::Select(
+		uint8_t prev1,
+		uint8_t prev2,
+		uint8_t expected,
+		bool afterMatch)
+	{
+		//the order-2 table is split into 256-entry slots, one per hashed context,
+		//so the bits of one byte stay close together in memory
+		uint32_t key = ((uint32_t)prev2 << 8) | prev1;
+		uint32_t slot = (key * 2654435761u) >> (32 - (order2Bits - 8));
+
+		return
+		{
+			order1.data() + (size_t)prev1 * 256,
+			order2.data() + (size_t)slot * 256,
+			expected,
+			afterMatch
+		};
+	}
+
+	uint32_t LiteralModel::Predict(
+		const Context& context,
+		size_t bitIndex,
+		uint32_t node,
+		int32_t st[INPUTS],
+		uint32_t* slots[INPUTS - 1],
+		int32_t*& w)
+	{
+		//the expected byte only says something while the bits so far agree with it
+		uint32_t expectedNode = (context.expected | 0x100u) >> (8 - bitIndex);
+		bool agrees = expectedNode == node;
+		uint32_t expectedBit = (context.expected >> (7 - bitIndex)) & 1;
+
+		uint32_t index = NibbleIndex(node, bitIndex);
+
+		slots[0] = &order0[node];
+		slots[1] = &context.o1[index];
+		slots[2] = &context.o2[index];
+		slots[3] = agrees
+			? &expect[((size_t)context.expected << 8 | node) * 2 + 1]
+			: &expect[((size_t)expectedBit << 8 | node) * 2];
+
+		for (size_t i = 0; i < INPUTS - 1; i++) st[i] = Stretch(*slots[i] >> 20);
+		st[INPUTS - 1] = 256;
+
+		w = weights.data() + (((context.afterMatch ? 2 : 0) + (agrees ? 1 : 0)) * 8 + bitIndex) * INPUTS;
+
+		int64_t dot = 0;
+		for (size_t i = 0; i < INPUTS; i++) dot += (int64_t)w[i] * st[i];
+
+		return Squash((int32_t)(dot >> 16));
+	}
+
+	void LiteralModel::Update(
+		const int32_t st[INPUTS],
+		uint32_t* const slots[INPUTS - 1],
+		int32_t* w,
+		uint32_t chance,
+		uint32_t bit)
+	{
+		//move every weight along its input in the direction that shrinks the error
+		int32_t error = ((int32_t)(bit << 12) - (int32_t)chance) * MIXER_RATE;
+		for (size_t i = 0; i < INPUTS; i++)
+		{
+			w[i] += (st[i] * error) >> 13;
+		}
+
+		UpdateCounter(*slots[0], bit, COUNT_LIMIT_ORDER0);
+		UpdateCounter(*slots[1], bit, COUNT_LIMIT_ORDER1);
+		UpdateCounter(*slots[2], bit, COUNT_LIMIT_ORDER2);
+		UpdateCounter(*slots[3], bit, COUNT_LIMIT_EXPECT);
+	}
+}
+
+vector<int16_t> BuildStretchTable()
+{
+	vector<int16_t> table(4096);
+	for (int i = 0; i < 4096; i++)
+	{
+		//a chance of 0 is never coded, it sits at the end of the range
+		double p = (i == 0 ? 0.5 : i) / 4096.0;
+		double value = log(p / (1.0 - p)) * 256.0;
+
+		if (value > STRETCH_LIMIT) value = STRETCH_LIMIT;
+		if (value < -STRETCH_LIMIT) value = -STRETCH_LIMIT;
+
+		table[i] = (int16_t)lround(value);
+	}
+	return table;
+}
+
+vector<int16_t> BuildSquashTable()
+{
+	vector<int16_t> table(STRETCH_LIMIT * 2 + 1);
+	for (int i = 0; i <= STRETCH_LIMIT * 2; i++)
+	{
+		double value = (double)(i - STRETCH_LIMIT) / 256.0;
+		long chance = lround(4096.0 / (1.0 + exp(-value)));
+
+		if (chance < 1) chance = 1;
+		if (chance > 4095) chance = 4095;
+
+		table[i] = (int16_t)chance;
+	}
+	return table;
+}
+
+vector<int32_t> BuildReciprocalTable()
+{
+	vector<int32_t> table(COUNT_LIMIT_ORDER0 + 1);
+	for (uint32_t i = 0; i < table.size(); i++)
+	{
+		table[i] = (int32_t)(65536 * 2 / (2 * i + 3));
+	}
+	return table;
+}
+
+uint32_t NibbleIndex(
+	uint32_t node,
+	size_t bitIndex)
+{
+	//the high nibble walks entries 1-15, then every high nibble value gets 15 entries
+	//of its own for the low nibble, so each nibble touches one or two cache lines
+	if (bitIndex < 4) return node;
+
+	uint32_t shift = (uint32_t)bitIndex - 4;
+	uint32_t high = (node >> shift) & 0xF;
+	uint32_t lowNode = (1u << shift) | (node & ((1u << shift) - 1));
+
+	return 16 + high * 15 + lowNode - 1;
+}
+
+int32_t Stretch(uint32_t chance)
+{
+	return stretchTable[chance];
+}
+
+uint32_t Squash(int32_t value)
+{
+	if (value > STRETCH_LIMIT) value = STRETCH_LIMIT;
+	if (value < -STRETCH_LIMIT) value = -STRETCH_LIMIT;
+
+	return (uint32_t)squashTable[value + STRETCH_LIMIT];
+}
+
+void UpdateCounter(
+	uint32_t& counter,
+	uint32_t bit,
+	uint32_t limit)
+{
+	//the first updates move the chance a long way, later ones settle
+	//towards a running average over the last limit bits
+	uint32_t chance = counter >> 16;
+	uint32_t count = counter & 0xFFFF;
+
+	int32_t target = bit ? 65535 : 0;
+	chance += (int32_t)(((int64_t)(target - (int32_t)chance) * reciprocalTable[count]) >> 16);
+
+	if (count < limit) count++;
+	counter = (chance << 16) | count;
+}
@@ -0,0 +1,280 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define KALADATA_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#include <cstring>
+
+#include "simd.hpp"
+
+using KalaData::Simd;
+using KalaData::SimdLevel;
+
+using std::memcpy;
+
+static SimdLevel DetectLevel();
+
+static size_t CountTrailingZeros(uint64_t value);
+
+static size_t MatchLengthScalar(
+	const uint8_t* a,
+	const uint8_t* b,
+	size_t limit);
+
+static void CopyMatchScalar(
+	uint8_t* dst,
+	size_t offset,
+	size_t length);
+
+#ifdef KALADATA_X86
+static size_t MatchLengthSSE2(
+	const uint8_t* a,
+	const uint8_t* b,
+	size_t limit);
+
+static size_t MatchLengthAVX2(
+	const uint8_t* a,
+	const uint8_t* b,
+	size_t limit);
+
+static void CopyMatchSSE2(
+	uint8_t* dst,
+	size_t offset,
+	size_t length);
+
+static void CopyMatchAVX2(
+	uint8_t* dst,
+	size_t offset,
+	size_t length);
+#endif
+
+namespace KalaData
+{
+	SimdLevel Simd::level = DetectLevel();
+
+#ifdef KALADATA_X86
+	size_t (*Simd::matchLength)(const uint8_t*, const uint8_t*, size_t) =
+		level == SimdLevel::SIMD_AVX2 ? MatchLengthAVX2
+		: level == SimdLevel::SIMD_SSE2 ? MatchLengthSSE2
+		: MatchLengthScalar;
+
+	void (*Simd::copyMatch)(uint8_t*, size_t, size_t) =
+		level == SimdLevel::SIMD_AVX2 ? CopyMatchAVX2
+		: level == SimdLevel::SIMD_SSE2 ? CopyMatchSSE2
+		: CopyMatchScalar;
+#else
+	size_t (*Simd::matchLength)(const uint8_t*, const uint8_t*, size_t) = MatchLengthScalar;
+	void (*Simd::copyMatch)(uint8_t*, size_t, size_t) = CopyMatchScalar;
+#endif
+
+	string Simd::GetLevelName()
+	{
+		switch (level)
+		{
+		case SimdLevel::SIMD_AVX2:
+			return "AVX2";
+		case SimdLevel::SIMD_SSE2:
+			return "SSE2";
+		default:
+			return "scalar";
+		}
+	}
+}
+
+SimdLevel DetectLevel()
+{
+#ifdef KALADATA_X86
+#ifdef _MSC_VER
+	int info[4]{};
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	if (maxLeaf >= 7)
+	{
+		__cpuid(info, 1);
+		bool hasOsxsave = (info[2] & (1 << 27)) != 0;
+		bool hasAvx = (info[2] & (1 << 28)) != 0;
+
+		__cpuidex(info, 7, 0);
+		bool hasAvx2 = (info[1] & (1 << 5)) != 0;
+
+		//the OS must also save the upper halves of the ymm registers
+		if (hasOsxsave
+			&& hasAvx
+			&& hasAvx2
+			&& (_xgetbv(0) & 6) == 6)
+		{
+			return SimdLevel::SIMD_AVX2;
+		}
+	}
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return SimdLevel::SIMD_AVX2;
+#endif
+	//every x86-64 cpu has SSE2
+	return SimdLevel::SIMD_SSE2;
+#else
+	return SimdLevel::SIMD_SCALAR;
+#endif
+}
+
+size_t CountTrailingZeros(uint64_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index{};
+	_BitScanForward64(&index, value);
+	return index;
+#else
+	return static_cast<size_t>(__builtin_ctzll(value));
+#endif
+}
+
+size_t MatchLengthScalar(
+	const uint8_t* a,
+	const uint8_t* b,
+	size_t limit)
+{
+	size_t length = 0;
+
+	//the first differing byte is the lowest set byte of the xor on little endian
+	while (length + sizeof(uint64_t) <= limit)
+	{
+		uint64_t x{};
+		uint64_t y{};
+		memcpy(&x, a + length, sizeof(uint64_t));
+		memcpy(&y, b + length, sizeof(uint64_t));
+
+		uint64_t diff = x ^ y;
+		if (diff != 0) return length + CountTrailingZeros(diff) / 8;
+
+		length += sizeof(uint64_t);
+	}
+
+	while (length < limit
+		&& a[length] == b[length])
+	{
+		length++;
+	}
+
+	return length;
+}
+
+void CopyMatchScalar(
+	uint8_t* dst,
+	size_t offset,
+	size_t length)
+{
+	const uint8_t* src = dst - offset;
+
+	//each 8-byte load only reads bytes that are already written
+	if (offset >= sizeof(uint64_t))
+	{
+		for (size_t i = 0; i < length; i += sizeof(uint64_t))
+		{
+			uint64_t chunk{};
+			memcpy(&chunk, src + i, sizeof(uint64_t));
+			memcpy(dst + i, &chunk, sizeof(uint64_t));
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < length; i++)
+	{
+		dst[i] = src[i];
+	}
+}
+
+#ifdef KALADATA_X86
+size_t MatchLengthSSE2(
+	const uint8_t* a,
+	const uint8_t* b,
+	size_t limit)
+{
+	size_t length = 0;
+
+	while (length + 16 <= limit)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + length));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + length));
+
+		uint32_t equal = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+		if (equal != 0xFFFF) return length + CountTrailingZeros(~equal);
+
+		length += 16;
+	}
+
+	return length + MatchLengthScalar(a + length, b + length, limit - length);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+size_t MatchLengthAVX2(
+	const uint8_t* a,
+	const uint8_t* b,
+	size_t limit)
+{
+	size_t length = 0;
+
+	while (length + 32 <= limit)
+	{
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + length));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + length));
+
+		uint32_t equal = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+		if (equal != 0xFFFFFFFF) return length + CountTrailingZeros(~static_cast<uint64_t>(equal));
+
+		length += 32;
+	}
+
+	return length + MatchLengthSSE2(a + length, b + length, limit - length);
+}
+
+void CopyMatchSSE2(
+	uint8_t* dst,
+	size_t offset,
+	size_t length)
+{
+	if (offset < 16)
+	{
+		CopyMatchScalar(dst, offset, length);
+		return;
+	}
+
+	const uint8_t* src = dst - offset;
+	for (size_t i = 0; i < length; i += 16)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), chunk);
+	}
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+void CopyMatchAVX2(
+	uint8_t* dst,
+	size_t offset,
+	size_t length)
+{
+	if (offset < 32)
+	{
+		CopyMatchSSE2(dst, offset, length);
+		return;
+	}
+
+	const uint8_t* src = dst - offset;
+	for (size_t i = 0; i < length; i += 32)
+	{
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), chunk);
+	}
+}
+#endif
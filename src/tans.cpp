@@ -0,0 +1,475 @@
+//Copyright(C) 2025 Lost Empire Entertainment
+//This program comes with ABSOLUTELY NO WARRANTY.
+//This is free software, and you are welcome to redistribute it under certain conditions.
+//Read LICENSE.md for more information.
+
+#include <vector>
+#include <cstring>
+#include <bit>
+
+#include "tans.hpp"
+#include "bitreader.hpp"
+
+using KalaData::Tans;
+using KalaData::BitReader;
+
+using std::vector;
+using std::memcpy;
+using std::memmove;
+using std::bit_width;
+
+//Smallest state table, below this the normalized counts get too coarse
+constexpr uint8_t MIN_TABLE_LOG = 5;
+
+//Symbols are spread over this many independent states so that
+//consecutive decode steps do not wait on each other
+constexpr size_t STATE_COUNT = 4;
+
+//Writes bits back to front into a buffer that is already large enough,
+//so that a decoder reading front to back sees the last written bits first
+struct ReverseBitWriter
+{
+	uint8_t* out;
+	uint64_t acc = 0;
+	uint32_t count = 0;
+
+	ReverseBitWriter(uint8_t* end) : out(end) {}
+
+	//Prepends the low length bits of value, length must not exceed 32
+	void Write(
+		uint32_t value,
+		uint32_t length)
+	{
+		acc |= (uint64_t)value << count;
+		count += length;
+
+		if (count >= 32)
+		{
+			uint32_t word = (uint32_t)acc;
+
+			out -= 4;
+			out[0] = (uint8_t)(word >> 24);
+			out[1] = (uint8_t)(word >> 16);
+			out[2] = (uint8_t)(word >> 8);
+			out[3] = (uint8_t)word;
+
+			acc >>= 32;
+			count -= 32;
+		}
+	}
+
+	//Stores the remaining bits and returns how many zero bits pad the first byte
+	uint8_t Flush()
+	{
+		while (count >= 8)
+		{
+			*--out = (uint8_t)acc;
+			acc >>= 8;
+			count -= 8;
+		}
+
+		uint8_t padBits = 0;
+		if (count > 0)
+		{
+			*--out = (uint8_t)acc;
+			padBits = (uint8_t)(8 - count);
+			count = 0;
+		}
+		return padBits;
+	}
+};
+
+struct DecodeEntry
+{
+	uint16_t newState;
+	uint8_t symbol;
+	uint8_t bits;
+};
+
+static uint8_t ChooseTableLog(
+	size_t symbolCount,
+	size_t usedSymbols);
+
+static void NormalizeCounts(
+	const size_t freq[256],
+	size_t total,
+	uint8_t tableLog,
+	uint32_t norm[256]);
+
+static void SpreadSymbols(
+	const uint32_t norm[256],
+	uint8_t tableLog,
+	vector<uint8_t>& tableSymbol);
+
+static void WriteVarint(
+	vector<uint8_t>& out,
+	uint32_t value);
+
+static bool ReadVarint(
+	const uint8_t* data,
+	size_t size,
+	size_t& pos,
+	uint32_t& value);
+
+namespace KalaData
+{
+	vector<uint8_t> Tans::Encode(const vector<uint8_t>& input)
+	{
+		if (input.empty()) return {};
+
+		size_t freq[256]{};
+		for (auto b : input) freq[b]++;
+
+		size_t usedSymbols = 0;
+		int lastSymbol = 0;
+		for (int i = 0; i < 256; i++)
+		{
+			if (freq[i] == 0) continue;
+
+			usedSymbols++;
+			lastSymbol = i;
+		}
+
+		uint8_t tableLog = ChooseTableLog(input.size(), usedSymbols);
+		uint32_t tableSize = 1u << tableLog;
+
+		uint32_t norm[256]{};
+		NormalizeCounts(freq, input.size(), tableLog, norm);
+
+		vector<uint8_t> tableSymbol{};
+		SpreadSymbols(norm, tableLog, tableSymbol);
+
+		//encoder state table: the slots of every symbol in table order,
+		//stored as the state value they stand for
+		uint32_t cumul[257]{};
+		for (int i = 0; i < 256; i++) cumul[i + 1] = cumul[i] + norm[i];
+
+		uint32_t next[256]{};
+		memcpy(next, cumul, sizeof(next));
+
+		vector<uint16_t> stateTable(tableSize);
+		for (uint32_t u = 0; u < tableSize; u++)
+		{
+			stateTable[next[tableSymbol[u]]++] = (uint16_t)(tableSize + u);
+		}
+
+		//per symbol transform: deltaBits gives the number of bits to flush for a state
+		//after adding it and shifting by 16, deltaState finds the next state in stateTable
+		uint32_t deltaBits[256]{};
+		int32_t deltaState[256]{};
+		for (int i = 0; i < 256; i++)
+		{
+			uint32_t count = norm[i];
+			if (count == 0) continue;
+
+			if (count == 1)
+			{
+				deltaBits[i] = ((uint32_t)tableLog << 16) - tableSize;
+				deltaState[i] = (int32_t)cumul[i] - 1;
+			}
+			else
+			{
+				uint32_t maxBitsOut = tableLog - (bit_width(count - 1) - 1);
+				uint32_t minStatePlus = count << maxBitsOut;
+
+				deltaBits[i] = (maxBitsOut << 16) - minStatePlus;
+				deltaState[i] = (int32_t)cumul[i] - (int32_t)count;
+			}
+		}
+
+		//header: symbol count, table log, highest used symbol and the normalized counts
+		vector<uint8_t> output{};
+
+		uint64_t symbolCount = input.size();
+		output.insert(
+			output.end(),
+			reinterpret_cast<uint8_t*>(&symbolCount),
+			reinterpret_cast<uint8_t*>(&symbolCount) + sizeof(uint64_t));
+
+		output.push_back(tableLog);
+		output.push_back((uint8_t)lastSymbol);
+
+		for (int i = 0; i <= lastSymbol; i++) WriteVarint(output, norm[i]);
+
+		size_t padPos = output.size();
+		output.push_back(0);
+
+		//a symbol never flushes more than tableLog bits
+		size_t headerSize = output.size();
+		size_t maxBytes = (input.size() * tableLog + STATE_COUNT * tableLog + 7) / 8 + 8;
+		output.resize(headerSize + maxBytes);
+
+		//encode back to front so the decoder can run front to back,
+		//symbol i belongs to state i % STATE_COUNT
+		uint32_t states[STATE_COUNT]{};
+		for (auto& state : states) state = tableSize;
+
+		ReverseBitWriter writer(output.data() + output.size());
+		for (size_t i = input.size(); i-- > 0;)
+		{
+			uint8_t symbol = input[i];
+			uint32_t& state = states[i % STATE_COUNT];
+
+			uint32_t bits = (state + deltaBits[symbol]) >> 16;
+			writer.Write(state & ((1u << bits) - 1), bits);
+			state = stateTable[(state >> bits) + deltaState[symbol]];
+		}
+
+		//the decoder reads the first state first, so it goes in last
+		for (size_t s = STATE_COUNT; s-- > 0;)
+		{
+			writer.Write(states[s] - tableSize, tableLog);
+		}
+		output[padPos] = writer.Flush();
+
+		size_t streamSize = (output.data() + output.size()) - writer.out;
+		memmove(output.data() + headerSize, writer.out, streamSize);
+		output.resize(headerSize + streamSize);
+
+		return output;
+	}
+
+	bool Tans::Decode(
+		const uint8_t* data,
+		size_t size,
+		size_t maxSymbols,
+		vector<uint8_t>& out)
+	{
+		size_t pos = 0;
+
+		if (size < sizeof(uint64_t) + 2) return false;
+
+		uint64_t symbolCount{};
+		memcpy(&symbolCount, data, sizeof(uint64_t));
+		pos += sizeof(uint64_t);
+
+		uint8_t tableLog = data[pos++];
+		size_t lastSymbol = data[pos++];
+
+		if (tableLog < MIN_TABLE_LOG
+			|| tableLog > MAX_TABLE_LOG)
+		{
+			return false;
+		}
+		uint32_t tableSize = 1u << tableLog;
+
+		uint32_t norm[256]{};
+		uint32_t total = 0;
+		for (size_t i = 0; i <= lastSymbol; i++)
+		{
+			if (!ReadVarint(data, size, pos, norm[i])
+				|| norm[i] > tableSize)
+			{
+				return false;
+			}
+			total += norm[i];
+		}
+		if (total != tableSize
+			|| pos >= size)
+		{
+			return false;
+		}
+
+		uint8_t padBits = data[pos++];
+		if (padBits > 7) return false;
+
+		//a dominant symbol can cost zero bits, so the stream size alone does not bound the count
+		if (symbolCount > maxSymbols) return false;
+
+		vector<uint8_t> tableSymbol{};
+		SpreadSymbols(norm, tableLog, tableSymbol);
+
+		//decode table: for every state the symbol it stands for, how many bits
+		//to read next and the base of the state those bits complete
+		uint32_t next[256]{};
+		memcpy(next, norm, sizeof(next));
+
+		vector<DecodeEntry> table(tableSize);
+		for (uint32_t u = 0; u < tableSize; u++)
+		{
+			uint8_t symbol = tableSymbol[u];
+			uint32_t x = next[symbol]++;
+			uint32_t bits = tableLog - (bit_width(x) - 1);
+
+			table[u] = { (uint16_t)((x << bits) - tableSize), symbol, (uint8_t)bits };
+		}
+
+		BitReader reader(data + pos, size - pos);
+		reader.Refill();
+
+		uint32_t skipped{};
+		bool valid = reader.Read(padBits, skipped);
+
+		uint32_t states[STATE_COUNT]{};
+		for (auto& state : states)
+		{
+			reader.Refill();
+			valid &= reader.Read(tableLog, state);
+		}
+
+		out.resize(static_cast<size_t>(symbolCount));
+		uint8_t* dst = out.data();
+
+		//while 8 bytes remain a refill always leaves 56 bits, which covers
+		//a symbol from every state without checking each read
+		size_t n = out.size();
+		size_t i = 0;
+		while (i + STATE_COUNT <= n
+			&& reader.end - reader.data >= 8
+			&& valid)
+		{
+			reader.Refill();
+
+			for (size_t s = 0; s < STATE_COUNT; s++)
+			{
+				const DecodeEntry& entry = table[states[s]];
+				dst[i + s] = entry.symbol;
+				states[s] = entry.newState + reader.ReadFast(entry.bits);
+			}
+			i += STATE_COUNT;
+		}
+		for (; i < n && valid; i++)
+		{
+			reader.Refill();
+
+			uint32_t& state = states[i % STATE_COUNT];
+			const DecodeEntry& entry = table[state];
+			dst[i] = entry.symbol;
+
+			uint32_t bits{};
+			valid &= reader.Read(entry.bits, bits);
+			state = entry.newState + bits;
+		}
+
+		//a genuine stream is used up exactly and returns every state to where the encoder began
+		if (!valid
+			|| reader.bitCount != 0
+			|| reader.data != reader.end)
+		{
+			return false;
+		}
+		for (auto state : states)
+		{
+			if (state != 0) return false;
+		}
+
+		return true;
+	}
+}
+
+uint8_t ChooseTableLog(
+	size_t symbolCount,
+	size_t usedSymbols)
+{
+	//a table much larger than the input only costs header and flush bits
+	uint8_t tableLog = MIN_TABLE_LOG;
+	while (tableLog < Tans::MAX_TABLE_LOG
+		&& (size_t(1) << tableLog) < symbolCount)
+	{
+		tableLog++;
+	}
+
+	//every used symbol needs at least one slot
+	while ((size_t(1) << tableLog) < usedSymbols) tableLog++;
+
+	return tableLog;
+}
+
+void NormalizeCounts(
+	const size_t freq[256],
+	size_t total,
+	uint8_t tableLog,
+	uint32_t norm[256])
+{
+	uint32_t tableSize = 1u << tableLog;
+	uint32_t sum = 0;
+	int largest = -1;
+
+	for (int i = 0; i < 256; i++)
+	{
+		norm[i] = 0;
+		if (freq[i] == 0) continue;
+
+		//round to the nearest slot count, a used symbol keeps at least one
+		uint64_t scaled = ((uint64_t)freq[i] * tableSize + total / 2) / total;
+		norm[i] = scaled > 0 ? (uint32_t)scaled : 1;
+		sum += norm[i];
+
+		if (largest < 0
+			|| freq[i] > freq[largest])
+		{
+			largest = i;
+		}
+	}
+
+	//hand leftover slots to the most common symbol, where they cost the least
+	if (sum < tableSize) norm[largest] += tableSize - sum;
+
+	//take surplus slots one at a time from whichever symbol has the most
+	while (sum > tableSize)
+	{
+		int most = 0;
+		for (int i = 1; i < 256; i++)
+		{
+			if (norm[i] > norm[most]) most = i;
+		}
+
+		norm[most]--;
+		sum--;
+	}
+}
+
+void SpreadSymbols(
+	const uint32_t norm[256],
+	uint8_t tableLog,
+	vector<uint8_t>& tableSymbol)
+{
+	//an odd step visits every slot once and scatters each symbol's
+	//slots across the table instead of bunching them together
+	uint32_t tableSize = 1u << tableLog;
+	uint32_t mask = tableSize - 1;
+	uint32_t step = (tableSize >> 1) + (tableSize >> 3) + 3;
+
+	tableSymbol.assign(tableSize, 0);
+
+	uint32_t position = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		for (uint32_t j = 0; j < norm[i]; j++)
+		{
+			tableSymbol[position] = (uint8_t)i;
+			position = (position + step) & mask;
+		}
+	}
+}
+
+void WriteVarint(
+	vector<uint8_t>& out,
+	uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((uint8_t)value);
+}
+
+bool ReadVarint(
+	const uint8_t* data,
+	size_t size,
+	size_t& pos,
+	uint32_t& value)
+{
+	value = 0;
+	for (uint32_t shift = 0; shift < 32; shift += 7)
+	{
+		if (pos >= size) return false;
+
+		uint8_t byte = data[pos++];
+		value |= (uint32_t)(byte & 0x7F) << shift;
+
+		if ((byte & 0x80) == 0) return true;
+	}
+	return false;
+}